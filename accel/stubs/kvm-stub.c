@@ -104,6 +104,15 @@ int kvm_on_sigbus(int code, void *addr)
     return 1;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+void kvm_dirty_ring_collect(void)
+{
+}
+
 bool kvm_memcrypt_enabled(void)
 {
     return false;
@@ -1113,6 +1113,12 @@ static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
         page_collection_unlock(pages);
     }
 
+    /* Account the page to this vcpu for cpu_dirty_limit_set() */
+    if (global_dirty_log &&
+        !cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION)) {
+        atomic_set(&cpu->dirty_pages, cpu->dirty_pages + 1);
+    }
+
     /*
      * Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
@@ -0,0 +1,450 @@
+/*
+ * Persistent translation block cache for user-mode emulation
+ *
+ * Short-lived guest processes spend most of their time translating the
+ * same code over and over.  At exit we dump the used part of the
+ * code_gen_buffer, together with a copy of the guest bytes each TB was
+ * generated from, into a file keyed by the guest binary.  The next run
+ * copies the host code back into code_gen_buffer and tb_gen_code() hands
+ * out the cached TBs whose guest bytes still match.
+ *
+ * Host code contains absolute addresses (helpers, the TB itself for
+ * exit_tb, guest_base), so there is no relocation step: a cache file is
+ * only used when the host layout is identical to the one that wrote it.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/cpu_ldst.h"
+#include "exec/tb-cache.h"
+#include "exec/tb-hash.h"
+#include "tcg/tcg.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+#define TB_CACHE_MAGIC   "QEMUTBC"
+#define TB_CACHE_VERSION 1
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_tbs;
+    /* identity of the QEMU binary and of the host layout */
+    uint64_t exe_dev;
+    uint64_t exe_ino;
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    uint64_t host_text;
+    uint64_t prologue;
+    uint64_t buffer;
+    uint64_t buffer_size;
+    uint64_t guest_base;
+    /* payload sizes */
+    uint64_t guest_size;
+    uint64_t code_size;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t tb_offset;     /* of the TranslationBlock in code_gen_buffer */
+    uint64_t guest_offset;  /* of its guest code in the guest blob */
+} TBCacheEntry;
+
+static char *tb_cache_dir;
+static char *tb_cache_path;
+/* TranslationBlock * -> guest bytes, protected by mmap_lock */
+static GHashTable *tb_cache_table;
+static uint8_t *tb_cache_guest;
+
+static guint tb_cache_hash(gconstpointer p)
+{
+    const TranslationBlock *tb = p;
+
+    return tb_hash_func(tb->pc, tb->pc, tb->flags,
+                        tb->cflags & CF_HASH_MASK, tb->trace_vcpu_dstate);
+}
+
+static gboolean tb_cache_equal(gconstpointer ap, gconstpointer bp)
+{
+    const TranslationBlock *a = ap;
+    const TranslationBlock *b = bp;
+
+    return a->pc == b->pc &&
+        a->cs_base == b->cs_base &&
+        a->flags == b->flags &&
+        (a->cflags & CF_HASH_MASK) == (b->cflags & CF_HASH_MASK) &&
+        a->trace_vcpu_dstate == b->trace_vcpu_dstate;
+}
+
+void tb_cache_init(const char *dir)
+{
+    g_free(tb_cache_dir);
+    tb_cache_dir = g_strdup(dir);
+}
+
+bool tb_cache_enabled(void)
+{
+    return tb_cache_dir != NULL;
+}
+
+static void tb_cache_fill_header(TBCacheHeader *hdr)
+{
+    struct stat st;
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+    hdr->version = TB_CACHE_VERSION;
+    if (stat("/proc/self/exe", &st) == 0) {
+        hdr->exe_dev = st.st_dev;
+        hdr->exe_ino = st.st_ino;
+        hdr->exe_size = st.st_size;
+        hdr->exe_mtime = st.st_mtime;
+    }
+    hdr->host_text = (uintptr_t)tb_cache_save;
+    hdr->prologue = (uintptr_t)tcg_ctx->code_gen_prologue;
+    hdr->buffer = (uintptr_t)tcg_ctx->code_gen_buffer;
+    hdr->buffer_size = tcg_ctx->code_gen_buffer_size;
+    hdr->guest_base = guest_base;
+}
+
+static bool tb_cache_header_matches(const TBCacheHeader *a,
+                                    const TBCacheHeader *b)
+{
+    return !memcmp(a->magic, b->magic, sizeof(a->magic)) &&
+        a->version == b->version &&
+        a->exe_dev == b->exe_dev &&
+        a->exe_ino == b->exe_ino &&
+        a->exe_size == b->exe_size &&
+        a->exe_mtime == b->exe_mtime &&
+        a->host_text == b->host_text &&
+        a->prologue == b->prologue &&
+        a->buffer == b->buffer &&
+        a->buffer_size == b->buffer_size &&
+        a->guest_base == b->guest_base;
+}
+
+/*
+ * The TCG backend picks instructions according to the features of the host
+ * CPU, so a cache directory shared between machines must not mix them up.
+ */
+static void tb_cache_hash_host_cpu(GChecksum *sum)
+{
+    char *cpuinfo, **lines, **line;
+
+    if (!g_file_get_contents("/proc/cpuinfo", &cpuinfo, NULL, NULL)) {
+        return;
+    }
+    lines = g_strsplit(cpuinfo, "\n", -1);
+    for (line = lines; *line; line++) {
+        /* "flags" on x86, "Features" on ARM */
+        if (g_str_has_prefix(*line, "flags") ||
+            g_str_has_prefix(*line, "Features")) {
+            g_checksum_update(sum, (const guchar *)*line, strlen(*line));
+            break;
+        }
+    }
+    g_strfreev(lines);
+    g_free(cpuinfo);
+}
+
+/*
+ * The file name covers everything that changes the generated code but
+ * is not part of the TB lookup key: the guest binary itself, the CPU
+ * model including its feature properties (translators look at the
+ * features in env, not at the TB flags), single-stepping and the host
+ * CPU.
+ */
+static char *tb_cache_file_name(const char *exec_path, const char *cpu_model,
+                                const char *cpu_type)
+{
+    GChecksum *sum;
+    uint8_t buf[64 * 1024];
+    char *name = NULL;
+    ssize_t len;
+    int fd;
+
+    fd = open(exec_path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    sum = g_checksum_new(G_CHECKSUM_SHA256);
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto out;
+        }
+        g_checksum_update(sum, buf, len);
+    }
+    g_checksum_update(sum, (const guchar *)cpu_model, strlen(cpu_model) + 1);
+    g_checksum_update(sum, (const guchar *)cpu_type, strlen(cpu_type) + 1);
+    g_checksum_update(sum, (const guchar *)&singlestep, sizeof(singlestep));
+    tb_cache_hash_host_cpu(sum);
+    name = g_strdup_printf("%s/%s-%s.tbc", tb_cache_dir, TARGET_NAME,
+                           g_checksum_get_string(sum));
+out:
+    g_checksum_free(sum);
+    close(fd);
+    return name;
+}
+
+static bool tb_cache_read(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = read(fd, buf, len);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/*
+ * The file holds host code that we are about to run, so only trust it if
+ * nobody but us could have written it.
+ */
+static bool tb_cache_file_trusted(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 &&
+        S_ISREG(st.st_mode) &&
+        st.st_uid == geteuid() &&
+        !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/* Called before the first translation, from a single thread */
+void tb_cache_load(const char *exec_path, const char *cpu_model,
+                   const char *cpu_type)
+{
+    TBCacheHeader hdr, expected;
+    TBCacheEntry *entries = NULL;
+    uint8_t *buffer = tcg_ctx->code_gen_buffer;
+    size_t max_code_size;
+    uint32_t i;
+    int fd;
+
+    if (!tb_cache_dir) {
+        return;
+    }
+    g_assert(tcg_ctx->code_gen_ptr == tcg_ctx->code_gen_buffer);
+
+    tb_cache_table = g_hash_table_new(tb_cache_hash, tb_cache_equal);
+    tb_cache_path = tb_cache_file_name(exec_path, cpu_model, cpu_type);
+    if (!tb_cache_path) {
+        return;
+    }
+    fd = open(tb_cache_path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return;
+    }
+    if (!tb_cache_file_trusted(fd)) {
+        warn_report("ignoring translation cache '%s': it must be a regular "
+                    "file owned by the current user and writable only by it",
+                    tb_cache_path);
+        goto out;
+    }
+
+    tb_cache_fill_header(&expected);
+    max_code_size = (uint8_t *)tcg_ctx->code_gen_highwater - buffer;
+    if (!tb_cache_read(fd, &hdr, sizeof(hdr)) ||
+        !tb_cache_header_matches(&hdr, &expected) ||
+        hdr.code_size > max_code_size ||
+        hdr.guest_size > (uint64_t)hdr.nb_tbs * TARGET_PAGE_SIZE * 2) {
+        trace_tb_cache_reject(tb_cache_path);
+        goto out;
+    }
+
+    entries = g_new(TBCacheEntry, hdr.nb_tbs);
+    tb_cache_guest = g_malloc(hdr.guest_size);
+    if (!tb_cache_read(fd, entries, sizeof(*entries) * hdr.nb_tbs) ||
+        !tb_cache_read(fd, tb_cache_guest, hdr.guest_size) ||
+        !tb_cache_read(fd, buffer, hdr.code_size)) {
+        trace_tb_cache_reject(tb_cache_path);
+        goto fail;
+    }
+
+    for (i = 0; i < hdr.nb_tbs; i++) {
+        TranslationBlock *tb = (TranslationBlock *)(buffer +
+                                                    entries[i].tb_offset);
+
+        if (entries[i].tb_offset + sizeof(*tb) > hdr.code_size ||
+            (uint8_t *)tb->tc.ptr < buffer ||
+            (uint8_t *)tb->tc.ptr + tb->tc.size > buffer + hdr.code_size ||
+            entries[i].guest_offset + tb->size > hdr.guest_size) {
+            trace_tb_cache_reject(tb_cache_path);
+            g_hash_table_remove_all(tb_cache_table);
+            goto fail;
+        }
+        g_hash_table_replace(tb_cache_table, tb,
+                             tb_cache_guest + entries[i].guest_offset);
+    }
+
+    flush_icache_range((uintptr_t)buffer, (uintptr_t)buffer + hdr.code_size);
+    atomic_set(&tcg_ctx->code_gen_ptr, buffer + hdr.code_size);
+    trace_tb_cache_load(tb_cache_path, hdr.nb_tbs, hdr.code_size);
+    goto out;
+
+fail:
+    g_free(tb_cache_guest);
+    tb_cache_guest = NULL;
+out:
+    g_free(entries);
+    close(fd);
+}
+
+/*
+ * Return a cached TB for the given lookup key, or NULL if there is none
+ * or the guest code it was translated from has changed.  The caller is
+ * responsible for resetting the jumps and linking the TB.
+ *
+ * Called with mmap_lock held.
+ */
+TranslationBlock *tb_cache_lookup(CPUState *cpu, target_ulong pc,
+                                  target_ulong cs_base, uint32_t flags,
+                                  uint32_t cflags)
+{
+    TranslationBlock key, *tb;
+    gpointer orig_key, guest;
+
+    if (!tb_cache_table || !g_hash_table_size(tb_cache_table)) {
+        return NULL;
+    }
+
+    key.pc = pc;
+    key.cs_base = cs_base;
+    key.flags = flags;
+    key.cflags = cflags;
+    key.trace_vcpu_dstate = *cpu->trace_dstate;
+    if (!g_hash_table_lookup_extended(tb_cache_table, &key,
+                                      &orig_key, &guest)) {
+        return NULL;
+    }
+    tb = orig_key;
+    /* Whatever happens, each cached TB is handed out at most once.  */
+    g_hash_table_remove(tb_cache_table, tb);
+
+    if (page_check_range(pc, tb->size, PAGE_READ | PAGE_EXEC) != 0 ||
+        memcmp(g2h(pc), guest, tb->size) != 0) {
+        trace_tb_cache_stale(tb, pc);
+        return NULL;
+    }
+    tb->cflags = cflags;
+    tb->orig_tb = NULL;
+    trace_tb_cache_hit(tb, pc);
+    return tb;
+}
+
+/* Called with mmap_lock held, when code_gen_buffer is reset */
+void tb_cache_flush(void)
+{
+    if (tb_cache_table) {
+        g_hash_table_remove_all(tb_cache_table);
+    }
+    g_free(tb_cache_guest);
+    tb_cache_guest = NULL;
+}
+
+typedef struct TBCacheWriter {
+    GArray *entries;
+    GByteArray *guest;
+} TBCacheWriter;
+
+static void tb_cache_add(TBCacheWriter *w, const TranslationBlock *tb,
+                         const void *guest)
+{
+    TBCacheEntry entry = {
+        .tb_offset = (uint8_t *)tb - (uint8_t *)tcg_ctx->code_gen_buffer,
+        .guest_offset = w->guest->len,
+    };
+
+    g_byte_array_append(w->guest, guest, tb->size);
+    g_array_append_val(w->entries, entry);
+}
+
+static gboolean tb_cache_collect(gpointer key, gpointer value, gpointer data)
+{
+    const TranslationBlock *tb = value;
+
+    if (tb->size == 0 || (tb_cflags(tb) & (CF_INVALID | CF_NOCACHE)) ||
+        page_check_range(tb->pc, tb->size, PAGE_READ | PAGE_EXEC) != 0) {
+        return false;
+    }
+    tb_cache_add(data, tb, g2h(tb->pc));
+    return false;
+}
+
+static void tb_cache_collect_unused(gpointer key, gpointer value,
+                                    gpointer data)
+{
+    tb_cache_add(data, key, value);
+}
+
+/* Called at guest exit */
+void tb_cache_save(void)
+{
+    TBCacheWriter w;
+    TBCacheHeader hdr;
+    char *tmp;
+    int fd;
+
+    if (!tb_cache_path) {
+        return;
+    }
+
+    mmap_lock();
+    w.entries = g_array_new(false, false, sizeof(TBCacheEntry));
+    w.guest = g_byte_array_new();
+    tcg_tb_foreach(tb_cache_collect, &w);
+    /* Keep the cached TBs that this run did not get to use.  */
+    g_hash_table_foreach(tb_cache_table, tb_cache_collect_unused, &w);
+
+    tb_cache_fill_header(&hdr);
+    hdr.nb_tbs = w.entries->len;
+    hdr.guest_size = w.guest->len;
+    hdr.code_size = (uint8_t *)tcg_ctx->code_gen_ptr -
+                    (uint8_t *)tcg_ctx->code_gen_buffer;
+
+    /* Write to a temporary file so that concurrent runs never see a torn
+     * cache.  */
+    tmp = g_strdup_printf("%s.XXXXXX", tb_cache_path);
+    fd = g_mkstemp(tmp);
+    if (fd < 0) {
+        goto out;
+    }
+    if (qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        qemu_write_full(fd, w.entries->data,
+                        w.entries->len * sizeof(TBCacheEntry)) !=
+            w.entries->len * sizeof(TBCacheEntry) ||
+        qemu_write_full(fd, w.guest->data, w.guest->len) != w.guest->len ||
+        qemu_write_full(fd, tcg_ctx->code_gen_buffer, hdr.code_size) !=
+            hdr.code_size) {
+        warn_report("could not write translation cache '%s': %s",
+                    tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+    close(fd);
+    if (rename(tmp, tb_cache_path) < 0) {
+        unlink(tmp);
+        goto out;
+    }
+    trace_tb_cache_save(tb_cache_path, hdr.nb_tbs, hdr.code_size);
+
+out:
+    g_free(tmp);
+    g_array_free(w.entries, true);
+    g_byte_array_free(w.guest, true);
+    mmap_unlock();
+}
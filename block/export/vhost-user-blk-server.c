@@ -0,0 +1,696 @@
+/*
+ * Sharing QEMU block devices via vhost-user protocol
+ *
+ * Parts of the code based on contrib/vhost-user-blk/vhost-user-blk.c and
+ * hw/block/virtio-blk.c.
+ *
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi/visitor.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/module.h"
+#include "qom/object_interfaces.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "sysemu/block-backend.h"
+#include "vhost-user-server.h"
+
+#define TYPE_VHOST_USER_BLK_SERVER "vhost-user-blk-server"
+#define VHOST_USER_BLK_SERVER(obj) \
+    OBJECT_CHECK(VuBlockDev, obj, TYPE_VHOST_USER_BLK_SERVER)
+
+enum {
+    VHOST_USER_BLK_MAX_QUEUES = 1,
+};
+
+struct virtio_blk_inhdr {
+    unsigned char status;
+};
+
+typedef struct VuBlockDev {
+    Object parent_obj;
+    char *node_name;
+    char *unix_socket;
+    bool writable;
+    uint32_t blk_size;
+
+    VuServer vu_server;
+    bool running;
+    BlockBackend *blk;
+    Notifier remove_bs_notifier;
+    struct virtio_blk_config blkcfg;
+} VuBlockDev;
+
+typedef struct VuBlockReq {
+    VuVirtqElement elem;
+    int64_t sector_num;
+    size_t size;
+    struct virtio_blk_inhdr *in;
+    struct virtio_blk_outhdr out;
+    VuServer *server;
+    struct VuVirtq *vq;
+} VuBlockReq;
+
+static VuBlockDev *vu_block_dev_from_server(VuServer *server)
+{
+    return container_of(server, VuBlockDev, vu_server);
+}
+
+static void vu_block_req_complete(VuBlockReq *req)
+{
+    VuDev *vu_dev = &req->server->vu_dev;
+
+    /* IO size with 1 extra status byte */
+    vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
+    vu_queue_notify(vu_dev, req->vq);
+}
+
+static bool vu_block_sect_range_ok(VuBlockDev *vdev_blk, uint64_t sector,
+                                   size_t size)
+{
+    uint64_t nb_sectors = size >> BDRV_SECTOR_BITS;
+    uint64_t total_sectors;
+
+    if (nb_sectors > BDRV_REQUEST_MAX_SECTORS) {
+        return false;
+    }
+    if ((sector << BDRV_SECTOR_BITS) % vdev_blk->blk_size) {
+        return false;
+    }
+    if (size % vdev_blk->blk_size) {
+        return false;
+    }
+
+    total_sectors = le64_to_cpu(vdev_blk->blkcfg.capacity);
+    if (sector > total_sectors || nb_sectors > total_sectors - sector) {
+        return false;
+    }
+    return true;
+}
+
+static int coroutine_fn
+vu_block_discard_write_zeroes(VuBlockReq *req, struct iovec *iov,
+                              uint32_t iovcnt, uint32_t type)
+{
+    VuBlockDev *vdev_blk = vu_block_dev_from_server(req->server);
+    struct virtio_blk_discard_write_zeroes desc;
+    uint64_t sector;
+    uint32_t num_sectors;
+    size_t size;
+
+    /* Only one desc is currently supported */
+    if (unlikely(iov_size(iov, iovcnt) > sizeof(desc))) {
+        return VIRTIO_BLK_S_UNSUPP;
+    }
+
+    size = iov_to_buf(iov, iovcnt, 0, &desc, sizeof(desc));
+    if (unlikely(size != sizeof(desc))) {
+        error_report("Invalid size %zu, expected %zu", size, sizeof(desc));
+        return VIRTIO_BLK_S_IOERR;
+    }
+
+    sector = le64_to_cpu(desc.sector);
+    num_sectors = le32_to_cpu(desc.num_sectors);
+    if (!vu_block_sect_range_ok(vdev_blk, sector,
+                                (uint64_t)num_sectors << BDRV_SECTOR_BITS)) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+
+    if (type == VIRTIO_BLK_T_DISCARD) {
+        /* No flags are defined for discard, the unmap flag is reserved */
+        if (le32_to_cpu(desc.flags)) {
+            return VIRTIO_BLK_S_UNSUPP;
+        }
+        if (blk_co_pdiscard(vdev_blk->blk, sector << BDRV_SECTOR_BITS,
+                            num_sectors << BDRV_SECTOR_BITS) < 0) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+    } else {
+        BdrvRequestFlags flags = 0;
+
+        if (le32_to_cpu(desc.flags) & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) {
+            return VIRTIO_BLK_S_UNSUPP;
+        }
+        if (le32_to_cpu(desc.flags) & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) {
+            flags |= BDRV_REQ_MAY_UNMAP;
+        }
+        if (blk_co_pwrite_zeroes(vdev_blk->blk, sector << BDRV_SECTOR_BITS,
+                                 num_sectors << BDRV_SECTOR_BITS,
+                                 flags) < 0) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+    }
+
+    return VIRTIO_BLK_S_OK;
+}
+
+static void coroutine_fn vu_block_virtio_process_req(void *opaque)
+{
+    VuBlockReq *req = opaque;
+    VuServer *server = req->server;
+    VuVirtqElement *elem = &req->elem;
+    VuBlockDev *vdev_blk = vu_block_dev_from_server(server);
+    BlockBackend *blk = vdev_blk->blk;
+    struct iovec *in_iov = elem->in_sg;
+    struct iovec *out_iov = elem->out_sg;
+    unsigned in_num = elem->in_num;
+    unsigned out_num = elem->out_num;
+    uint32_t type;
+
+    /* refer to hw/block/virtio_blk.c */
+    if (elem->out_num < 1 || elem->in_num < 1) {
+        error_report("virtio-blk request missing headers");
+        goto err;
+    }
+
+    if (unlikely(iov_to_buf(out_iov, out_num, 0, &req->out,
+                            sizeof(req->out)) != sizeof(req->out))) {
+        error_report("virtio-blk request outhdr too short");
+        goto err;
+    }
+    iov_discard_front(&out_iov, &out_num, sizeof(req->out));
+
+    if (in_iov[in_num - 1].iov_len < sizeof(struct virtio_blk_inhdr)) {
+        error_report("virtio-blk request inhdr too short");
+        goto err;
+    }
+
+    /* We always touch the last byte, so just see how big in_iov is. */
+    req->in = (void *)in_iov[in_num - 1].iov_base
+              + in_iov[in_num - 1].iov_len
+              - sizeof(struct virtio_blk_inhdr);
+    iov_discard_back(in_iov, &in_num, sizeof(struct virtio_blk_inhdr));
+
+    type = le32_to_cpu(req->out.type);
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT: {
+        QEMUIOVector qiov;
+        int64_t offset;
+        ssize_t ret = 0;
+        bool is_write = type & VIRTIO_BLK_T_OUT;
+
+        req->sector_num = le64_to_cpu(req->out.sector);
+
+        if (is_write && !vdev_blk->writable) {
+            req->in->status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+
+        if (is_write) {
+            qemu_iovec_init_external(&qiov, out_iov, out_num);
+        } else {
+            qemu_iovec_init_external(&qiov, in_iov, in_num);
+        }
+
+        if (unlikely(!vu_block_sect_range_ok(vdev_blk, req->sector_num,
+                                             qiov.size))) {
+            req->in->status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+
+        offset = req->sector_num << BDRV_SECTOR_BITS;
+
+        if (is_write) {
+            ret = blk_co_pwritev(blk, offset, qiov.size, &qiov, 0);
+        } else {
+            ret = blk_co_preadv(blk, offset, qiov.size, &qiov, 0);
+            req->size = qiov.size;
+        }
+        if (ret >= 0) {
+            req->in->status = VIRTIO_BLK_S_OK;
+        } else {
+            req->in->status = VIRTIO_BLK_S_IOERR;
+        }
+        break;
+    }
+    case VIRTIO_BLK_T_FLUSH:
+        if (blk_co_flush(blk) == 0) {
+            req->in->status = VIRTIO_BLK_S_OK;
+        } else {
+            req->in->status = VIRTIO_BLK_S_IOERR;
+        }
+        break;
+    case VIRTIO_BLK_T_GET_ID: {
+        size_t size = MIN(iov_size(in_iov, in_num), VIRTIO_BLK_ID_BYTES);
+
+        req->size = iov_from_buf(in_iov, in_num, 0, vdev_blk->node_name,
+                                 MIN(size, strlen(vdev_blk->node_name)));
+        req->in->status = VIRTIO_BLK_S_OK;
+        break;
+    }
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES: {
+        if (!vdev_blk->writable) {
+            req->in->status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        req->in->status = vu_block_discard_write_zeroes(req, out_iov, out_num,
+                                                        type);
+        break;
+    }
+    default:
+        req->in->status = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+
+    vu_block_req_complete(req);
+    free(req);
+    vhost_user_server_dec_in_flight(server);
+    return;
+
+err:
+    /* Like virtio_error(), a malformed request breaks the device */
+    free(req);
+    server->vu_dev.panic(&server->vu_dev, NULL);
+    vhost_user_server_dec_in_flight(server);
+}
+
+static void vu_block_process_vq(VuDev *vu_dev, int idx)
+{
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuVirtq *vq = vu_get_queue(vu_dev, idx);
+
+    while (1) {
+        VuBlockReq *req;
+        Coroutine *co;
+
+        req = vu_queue_pop(vu_dev, vq, sizeof(VuBlockReq));
+        if (!req) {
+            break;
+        }
+
+        req->server = server;
+        req->vq = vq;
+        req->size = 0;
+
+        co = qemu_coroutine_create(vu_block_virtio_process_req, req);
+        vhost_user_server_inc_in_flight(server);
+        qemu_coroutine_enter(co);
+    }
+}
+
+static void vu_block_queue_set_started(VuDev *vu_dev, int idx, bool started)
+{
+    VuVirtq *vq;
+
+    assert(vu_dev);
+
+    vq = vu_get_queue(vu_dev, idx);
+    vu_set_queue_handler(vu_dev, vq, started ? vu_block_process_vq : NULL);
+}
+
+static uint64_t vu_block_get_features(VuDev *dev)
+{
+    uint64_t features;
+    VuServer *server = container_of(dev, VuServer, vu_dev);
+    VuBlockDev *vdev_blk = vu_block_dev_from_server(server);
+
+    features = 1ull << VIRTIO_BLK_F_SEG_MAX |
+               1ull << VIRTIO_BLK_F_TOPOLOGY |
+               1ull << VIRTIO_BLK_F_BLK_SIZE |
+               1ull << VIRTIO_BLK_F_FLUSH |
+               1ull << VIRTIO_BLK_F_DISCARD |
+               1ull << VIRTIO_BLK_F_WRITE_ZEROES |
+               1ull << VIRTIO_BLK_F_CONFIG_WCE |
+               1ull << VIRTIO_F_VERSION_1 |
+               1ull << VIRTIO_RING_F_INDIRECT_DESC |
+               1ull << VIRTIO_RING_F_EVENT_IDX |
+               1ull << VHOST_USER_F_PROTOCOL_FEATURES;
+
+    if (!vdev_blk->writable) {
+        features |= 1ull << VIRTIO_BLK_F_RO;
+    }
+
+    return features;
+}
+
+static uint64_t vu_block_get_protocol_features(VuDev *dev)
+{
+    return 1ull << VHOST_USER_PROTOCOL_F_CONFIG |
+           1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD;
+}
+
+static int vu_block_get_config(VuDev *vu_dev, uint8_t *config, uint32_t len)
+{
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlockDev *vdev_blk = vu_block_dev_from_server(server);
+
+    if (len > sizeof(vdev_blk->blkcfg)) {
+        return -1;
+    }
+
+    memcpy(config, &vdev_blk->blkcfg, len);
+    return 0;
+}
+
+static int vu_block_set_config(VuDev *vu_dev, const uint8_t *data,
+                               uint32_t offset, uint32_t size, uint32_t flags)
+{
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlockDev *vdev_blk = vu_block_dev_from_server(server);
+    uint8_t wce;
+
+    /* don't support live migration */
+    if (flags != VHOST_SET_CONFIG_TYPE_MASTER) {
+        return -EINVAL;
+    }
+
+    if (offset != offsetof(struct virtio_blk_config, wce) ||
+        size != 1) {
+        return -EINVAL;
+    }
+
+    wce = *data;
+    vdev_blk->blkcfg.wce = wce;
+    blk_set_enable_write_cache(vdev_blk->blk, wce);
+    return 0;
+}
+
+/*
+ * libvhost-user exits the process when it sees VHOST_USER_NONE, which is
+ * fine for a standalone server but not for us: just drop the client.
+ */
+static int vu_block_process_msg(VuDev *dev, VhostUserMsg *vmsg, int *do_reply)
+{
+    if (vmsg->request == VHOST_USER_NONE) {
+        dev->panic(dev, "disconnect");
+        return true;
+    }
+    return false;
+}
+
+static const VuDevIface vu_block_iface = {
+    .get_features          = vu_block_get_features,
+    .queue_set_started     = vu_block_queue_set_started,
+    .get_protocol_features = vu_block_get_protocol_features,
+    .get_config            = vu_block_get_config,
+    .set_config            = vu_block_set_config,
+    .process_msg           = vu_block_process_msg,
+};
+
+static void blk_aio_attached(AioContext *ctx, void *opaque)
+{
+    VuBlockDev *vub_dev = opaque;
+
+    vhost_user_server_attach_aio_context(&vub_dev->vu_server, ctx);
+}
+
+static void blk_aio_detach(void *opaque)
+{
+    VuBlockDev *vub_dev = opaque;
+
+    vhost_user_server_detach_aio_context(&vub_dev->vu_server);
+}
+
+static void
+vu_block_initialize_config(BlockBackend *blk,
+                           struct virtio_blk_config *config,
+                           uint32_t blk_size)
+{
+    config->capacity = cpu_to_le64(blk_getlength(blk) >> BDRV_SECTOR_BITS);
+    config->blk_size = cpu_to_le32(blk_size);
+    config->size_max = cpu_to_le32(0);
+    config->seg_max = cpu_to_le32(128 - 2);
+    config->min_io_size = cpu_to_le16(1);
+    config->opt_io_size = cpu_to_le32(1);
+    config->num_queues = cpu_to_le16(VHOST_USER_BLK_MAX_QUEUES);
+    config->max_discard_sectors = cpu_to_le32(32768);
+    config->max_discard_seg = cpu_to_le32(1);
+    config->discard_sector_alignment = cpu_to_le32(blk_size >> 9);
+    config->max_write_zeroes_sectors = cpu_to_le32(32768);
+    config->max_write_zeroes_seg = cpu_to_le32(1);
+    config->wce = blk_enable_write_cache(blk);
+}
+
+/* Called in the main loop with the BlockBackend's AioContext acquired */
+static void vhost_user_blk_server_stop(VuBlockDev *vu_block_device)
+{
+    if (!vu_block_device->running) {
+        return;
+    }
+
+    vhost_user_server_stop(&vu_block_device->vu_server);
+    vu_block_device->running = false;
+
+    notifier_remove(&vu_block_device->remove_bs_notifier);
+    blk_remove_aio_context_notifier(vu_block_device->blk, blk_aio_attached,
+                                    blk_aio_detach, vu_block_device);
+}
+
+/* The node is going away, e.g. on bdrv_close_all(); drop the client */
+static void vu_block_remove_bs_notify(Notifier *n, void *data)
+{
+    VuBlockDev *vu_block_device = container_of(n, VuBlockDev,
+                                               remove_bs_notifier);
+
+    vhost_user_blk_server_stop(vu_block_device);
+}
+
+static void vhost_user_blk_server_start(VuBlockDev *vu_block_device,
+                                        Error **errp)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk;
+    AioContext *ctx;
+    uint64_t perm = BLK_PERM_CONSISTENT_READ;
+    SocketAddress addr = {
+        .type = SOCKET_ADDRESS_TYPE_UNIX,
+        .u.q_unix.path = vu_block_device->unix_socket,
+    };
+    int ret;
+
+    if (!vu_block_device->node_name) {
+        error_setg(errp, "'node-name' is required");
+        return;
+    }
+    if (!vu_block_device->unix_socket) {
+        error_setg(errp, "'unix-socket' is required");
+        return;
+    }
+
+    bs = bdrv_lookup_bs(NULL, vu_block_device->node_name, errp);
+    if (!bs) {
+        return;
+    }
+
+    ctx = bdrv_get_aio_context(bs);
+    aio_context_acquire(ctx);
+    bdrv_invalidate_cache(bs, NULL);
+
+    if (vu_block_device->writable) {
+        perm |= BLK_PERM_WRITE;
+    }
+
+    /*
+     * Don't allow resize while the export is running, the capacity in the
+     * device configuration would get stale.
+     */
+    blk = blk_new(ctx, perm,
+                  BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED |
+                  BLK_PERM_WRITE | BLK_PERM_GRAPH_MOD);
+    ret = blk_insert_bs(blk, bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    blk_set_enable_write_cache(blk, true);
+    blk_set_allow_aio_context_change(blk, true);
+
+    vu_block_device->blk = blk;
+    vu_block_initialize_config(blk, &vu_block_device->blkcfg,
+                               vu_block_device->blk_size);
+
+    if (!vhost_user_server_start(&vu_block_device->vu_server, &addr, ctx,
+                                 VHOST_USER_BLK_MAX_QUEUES, &vu_block_iface,
+                                 errp)) {
+        goto fail;
+    }
+
+    vu_block_device->remove_bs_notifier.notify = vu_block_remove_bs_notify;
+    blk_add_remove_bs_notifier(blk, &vu_block_device->remove_bs_notifier);
+    blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach,
+                                 vu_block_device);
+    vu_block_device->running = true;
+
+    aio_context_release(ctx);
+    return;
+
+fail:
+    blk_unref(blk);
+    vu_block_device->blk = NULL;
+    aio_context_release(ctx);
+}
+
+static void vu_block_complete(UserCreatable *obj, Error **errp)
+{
+    vhost_user_blk_server_start(VHOST_USER_BLK_SERVER(obj), errp);
+}
+
+static void vu_set_node_name(Object *obj, const char *value, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+
+    if (vus->node_name) {
+        error_setg(errp, "node-name property already set");
+        return;
+    }
+
+    vus->node_name = g_strdup(value);
+}
+
+static char *vu_get_node_name(Object *obj, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+
+    return g_strdup(vus->node_name);
+}
+
+static void vu_set_unix_socket(Object *obj, const char *value, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+
+    if (vus->unix_socket) {
+        error_setg(errp, "unix-socket property already set");
+        return;
+    }
+
+    vus->unix_socket = g_strdup(value);
+}
+
+static char *vu_get_unix_socket(Object *obj, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+
+    return g_strdup(vus->unix_socket);
+}
+
+static bool vu_get_block_writable(Object *obj, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+
+    return vus->writable;
+}
+
+static void vu_set_block_writable(Object *obj, bool value, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+
+    if (vus->running) {
+        error_setg(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    vus->writable = value;
+}
+
+static void vu_get_blk_size(Object *obj, Visitor *v, const char *name,
+                            void *opaque, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+    uint32_t value = vus->blk_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void vu_set_blk_size(Object *obj, Visitor *v, const char *name,
+                            void *opaque, Error **errp)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    if (vus->running) {
+        error_setg(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* We rely on power-of-2 blocksizes for bitmasks */
+    if (value < BDRV_SECTOR_SIZE || value > 32768 ||
+        (value & (value - 1)) != 0) {
+        error_setg(errp, "Property '%s' must be a power of two between "
+                   "512 and 32768", name);
+        return;
+    }
+
+    vus->blk_size = value;
+}
+
+static void vhost_user_blk_server_instance_init(Object *obj)
+{
+    VuBlockDev *vus = VHOST_USER_BLK_SERVER(obj);
+
+    vus->blk_size = BDRV_SECTOR_SIZE;
+
+    object_property_add_str(obj, "node-name",
+                            vu_get_node_name,
+                            vu_set_node_name, NULL);
+    object_property_add_str(obj, "unix-socket",
+                            vu_get_unix_socket,
+                            vu_set_unix_socket, NULL);
+    object_property_add_bool(obj, "writable",
+                             vu_get_block_writable,
+                             vu_set_block_writable, NULL);
+    object_property_add(obj, "logical-block-size", "uint32",
+                        vu_get_blk_size, vu_set_blk_size,
+                        NULL, NULL, NULL);
+}
+
+static void vhost_user_blk_server_instance_finalize(Object *obj)
+{
+    VuBlockDev *vub = VHOST_USER_BLK_SERVER(obj);
+
+    if (vub->blk) {
+        AioContext *ctx = blk_get_aio_context(vub->blk);
+
+        aio_context_acquire(ctx);
+        vhost_user_blk_server_stop(vub);
+        blk_unref(vub->blk);
+        aio_context_release(ctx);
+    }
+
+    g_free(vub->node_name);
+    g_free(vub->unix_socket);
+}
+
+static void vhost_user_blk_server_class_init(ObjectClass *klass,
+                                             void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = vu_block_complete;
+}
+
+static const TypeInfo vhost_user_blk_server_info = {
+    .name = TYPE_VHOST_USER_BLK_SERVER,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(VuBlockDev),
+    .instance_init = vhost_user_blk_server_instance_init,
+    .instance_finalize = vhost_user_blk_server_instance_finalize,
+    .class_init = vhost_user_blk_server_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        {TYPE_USER_CREATABLE},
+        {}
+    },
+};
+
+static void vhost_user_blk_server_register_types(void)
+{
+    type_register_static(&vhost_user_blk_server_info);
+}
+
+type_init(vhost_user_blk_server_register_types)
@@ -0,0 +1,310 @@
+/*
+ * Sharing QEMU devices via vhost-user protocol
+ *
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "block/aio-wait.h"
+#include "vhost-user-server.h"
+
+static void vu_client_disconnect_bh(void *opaque);
+
+static void vu_fd_watch_handler(void *opaque)
+{
+    VuFdWatch *vu_fd_watch = opaque;
+
+    vu_fd_watch->cb(vu_fd_watch->vu_dev, VU_WATCH_IN, vu_fd_watch->pvt);
+}
+
+static void set_watch(VuDev *vu_dev, int fd, int vu_evt,
+                      vu_watch_cb cb, void *pvt)
+{
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuFdWatch *vu_fd_watch;
+
+    g_assert(vu_dev);
+    g_assert(fd >= 0);
+    g_assert(cb);
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->fd == fd) {
+            break;
+        }
+    }
+
+    if (!vu_fd_watch) {
+        vu_fd_watch = g_new0(VuFdWatch, 1);
+        QTAILQ_INSERT_TAIL(&server->vu_fd_watches, vu_fd_watch, next);
+    }
+
+    vu_fd_watch->fd = fd;
+    vu_fd_watch->cb = cb;
+    vu_fd_watch->pvt = pvt;
+    vu_fd_watch->vu_dev = vu_dev;
+
+    /*
+     * Kicks are guest requests, so they are external events and must not
+     * be processed while the block layer is drained.
+     */
+    aio_set_fd_handler(server->ctx, fd, true, vu_fd_watch_handler,
+                       NULL, NULL, vu_fd_watch);
+}
+
+static void remove_watch(VuDev *vu_dev, int fd)
+{
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuFdWatch *vu_fd_watch;
+
+    g_assert(vu_dev);
+    g_assert(fd >= 0);
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->fd == fd) {
+            break;
+        }
+    }
+
+    if (!vu_fd_watch) {
+        return;
+    }
+
+    aio_set_fd_handler(server->ctx, fd, true, NULL, NULL, NULL, NULL);
+    QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
+    g_free(vu_fd_watch);
+}
+
+static void panic_cb(VuDev *vu_dev, const char *buf)
+{
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+
+    if (buf) {
+        error_report("vu_panic: %s", buf);
+    }
+
+    /*
+     * We may be called from within vu_dispatch() or a virtqueue handler, so
+     * the actual teardown is deferred to a bottom half.  Stop reading
+     * messages right away, though; a broken device doesn't hand out any
+     * more virtqueue elements either.
+     */
+    vu_dev->broken = true;
+    if (!server->disconnecting) {
+        server->disconnecting = true;
+        aio_set_fd_handler(server->ctx, server->sioc->fd, true,
+                           NULL, NULL, NULL, NULL);
+        qemu_bh_schedule(server->disconnect_bh);
+    }
+}
+
+static void vu_client_read(void *opaque)
+{
+    VuServer *server = opaque;
+
+    if (!vu_dispatch(&server->vu_dev)) {
+        panic_cb(&server->vu_dev, "Error processing vhost message");
+    }
+}
+
+static void vu_client_set_handlers(VuServer *server, bool enable)
+{
+    VuFdWatch *vu_fd_watch;
+
+    aio_set_fd_handler(server->ctx, server->sioc->fd, true,
+                       enable ? vu_client_read : NULL, NULL, NULL, server);
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+                           enable ? vu_fd_watch_handler : NULL,
+                           NULL, NULL, vu_fd_watch);
+    }
+}
+
+static void vu_accept(QIONetListener *listener, QIOChannelSocket *sioc,
+                      gpointer opaque);
+
+/* Called with server->ctx acquired, once no requests are in flight */
+static void vu_client_disconnect(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch, *next;
+
+    assert(server->in_flight == 0);
+
+    vu_client_set_handlers(server, false);
+    QTAILQ_FOREACH_SAFE(vu_fd_watch, &server->vu_fd_watches, next, next) {
+        QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
+        g_free(vu_fd_watch);
+    }
+
+    /* The socket is owned by sioc, don't let libvhost-user close it */
+    server->vu_dev.sock = -1;
+    vu_deinit(&server->vu_dev);
+
+    qemu_bh_delete(server->disconnect_bh);
+    server->disconnect_bh = NULL;
+    server->disconnecting = false;
+
+    qio_channel_close(QIO_CHANNEL(server->sioc), NULL);
+    object_unref(OBJECT(server->sioc));
+    server->sioc = NULL;
+
+    /* Accept the next client */
+    if (server->listener) {
+        qio_net_listener_set_client_func(server->listener, vu_accept,
+                                         server, NULL);
+    }
+}
+
+static void vu_client_disconnect_bh(void *opaque)
+{
+    VuServer *server = opaque;
+
+    /* The last request to complete reschedules us */
+    if (server->in_flight == 0) {
+        vu_client_disconnect(server);
+    }
+}
+
+static void vu_accept(QIONetListener *listener, QIOChannelSocket *sioc,
+                      gpointer opaque)
+{
+    VuServer *server = opaque;
+
+    if (server->sioc) {
+        warn_report("Only one vhost-user client is allowed to "
+                    "connect to the server at a time");
+        return;
+    }
+
+    /* libvhost-user reads and writes its messages synchronously */
+    if (qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL) < 0) {
+        return;
+    }
+
+    aio_context_acquire(server->ctx);
+
+    if (!vu_init(&server->vu_dev, server->max_queues, sioc->fd, panic_cb,
+                 set_watch, remove_watch, server->vu_iface)) {
+        error_report("Failed to initialize libvhost-user");
+        aio_context_release(server->ctx);
+        return;
+    }
+
+    /* Serve one client at a time, new connections are refused */
+    qio_net_listener_set_client_func(server->listener, NULL, NULL, NULL);
+
+    object_ref(OBJECT(sioc));
+    qio_channel_set_name(QIO_CHANNEL(sioc), "vhost-user-server");
+    server->sioc = sioc;
+    server->disconnect_bh = aio_bh_new(server->ctx, vu_client_disconnect_bh,
+                                       server);
+    aio_set_fd_handler(server->ctx, sioc->fd, true, vu_client_read,
+                       NULL, NULL, server);
+
+    aio_context_release(server->ctx);
+}
+
+void vhost_user_server_inc_in_flight(VuServer *server)
+{
+    server->in_flight++;
+}
+
+void vhost_user_server_dec_in_flight(VuServer *server)
+{
+    assert(server->in_flight > 0);
+    server->in_flight--;
+
+    if (server->in_flight == 0) {
+        if (server->disconnecting) {
+            qemu_bh_schedule(server->disconnect_bh);
+        }
+        aio_wait_kick();
+    }
+}
+
+void vhost_user_server_detach_aio_context(VuServer *server)
+{
+    if (server->sioc) {
+        vu_client_set_handlers(server, false);
+        qemu_bh_delete(server->disconnect_bh);
+        server->disconnect_bh = NULL;
+    }
+    server->ctx = NULL;
+}
+
+void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
+{
+    server->ctx = ctx;
+    if (server->sioc) {
+        server->disconnect_bh = aio_bh_new(ctx, vu_client_disconnect_bh,
+                                           server);
+        if (server->disconnecting) {
+            qemu_bh_schedule(server->disconnect_bh);
+        } else {
+            vu_client_set_handlers(server, true);
+        }
+    }
+}
+
+/* Called in the main loop with the server's AioContext acquired */
+void vhost_user_server_stop(VuServer *server)
+{
+    if (server->listener) {
+        qio_net_listener_disconnect(server->listener);
+        object_unref(OBJECT(server->listener));
+        server->listener = NULL;
+    }
+
+    if (server->sioc) {
+        if (!server->disconnecting) {
+            server->disconnecting = true;
+            aio_set_fd_handler(server->ctx, server->sioc->fd, true,
+                               NULL, NULL, NULL, NULL);
+        }
+        AIO_WAIT_WHILE(server->ctx, server->in_flight > 0);
+        vu_client_disconnect(server);
+    }
+}
+
+/* Called in the main loop */
+bool vhost_user_server_start(VuServer *server,
+                             SocketAddress *socket_addr,
+                             AioContext *ctx,
+                             uint16_t max_queues,
+                             const VuDevIface *vu_iface,
+                             Error **errp)
+{
+    QIONetListener *listener;
+
+    if (socket_addr->type != SOCKET_ADDRESS_TYPE_UNIX &&
+        socket_addr->type != SOCKET_ADDRESS_TYPE_FD) {
+        error_setg(errp, "Only socket address types 'unix' and 'fd' "
+                   "are supported");
+        return false;
+    }
+
+    listener = qio_net_listener_new();
+    if (qio_net_listener_open_sync(listener, socket_addr, 1, errp) < 0) {
+        object_unref(OBJECT(listener));
+        return false;
+    }
+    qio_net_listener_set_name(listener, "vhost-user-backend-listener");
+
+    *server = (VuServer) {
+        .listener   = listener,
+        .ctx        = ctx,
+        .vu_iface   = vu_iface,
+        .max_queues = max_queues,
+    };
+    QTAILQ_INIT(&server->vu_fd_watches);
+
+    qio_net_listener_set_client_func(listener, vu_accept, server, NULL);
+
+    return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * Sharing QEMU devices via vhost-user protocol
+ *
+ * Copyright (c) 2020 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef VHOST_USER_SERVER_H
+#define VHOST_USER_SERVER_H
+
+#include "contrib/libvhost-user/libvhost-user.h"
+#include "io/channel-socket.h"
+#include "io/net-listener.h"
+#include "qapi/qapi-types-sockets.h"
+
+typedef struct VuFdWatch {
+    VuDev *vu_dev;
+    int fd; /* kick fd */
+    void *pvt;
+    vu_watch_cb cb;
+    QTAILQ_ENTRY(VuFdWatch) next;
+} VuFdWatch;
+
+/*
+ * A vhost-user server serves one client at a time.  All of the client's
+ * file descriptors (the vhost-user socket and the virtqueue kick eventfds)
+ * are handled in @ctx, so the device implementation runs entirely in that
+ * AioContext.  Connections are accepted in the main loop.
+ */
+typedef struct VuServer {
+    QIONetListener *listener;
+    AioContext *ctx;
+    const VuDevIface *vu_iface;
+    uint16_t max_queues;
+
+    /* Protected by ctx lock */
+    VuDev vu_dev;
+    QIOChannelSocket *sioc; /* the current client, NULL if none */
+    QEMUBH *disconnect_bh;
+    bool disconnecting;
+    unsigned int in_flight;
+    QTAILQ_HEAD(, VuFdWatch) vu_fd_watches;
+} VuServer;
+
+bool vhost_user_server_start(VuServer *server,
+                             SocketAddress *unix_socket,
+                             AioContext *ctx,
+                             uint16_t max_queues,
+                             const VuDevIface *vu_iface,
+                             Error **errp);
+
+void vhost_user_server_stop(VuServer *server);
+
+void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
+void vhost_user_server_detach_aio_context(VuServer *server);
+
+/*
+ * Requests that are still processed after being popped from a virtqueue
+ * must be accounted for, so that the client is only torn down once they
+ * have completed.
+ */
+void vhost_user_server_inc_in_flight(VuServer *server);
+void vhost_user_server_dec_in_flight(VuServer *server);
+
+#endif /* VHOST_USER_SERVER_H */
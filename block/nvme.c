@@ -531,6 +531,28 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
+/*
+ * The controller may refuse to create I/O queues until the host has told
+ * it how many it wants with Set Features / Number of Queues.
+ */
+static bool nvme_set_num_queues(BlockDriverState *bs, int nr_io_queues,
+                                Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        /* Both counts are zero based: completion queues, submission queues */
+        .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) | (nr_io_queues - 1)),
+    };
+
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        error_setg(errp, "Failed to set the number of I/O queues");
+        return false;
+    }
+    return true;
+}
+
 static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -690,7 +712,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_set_num_queues(bs, 1, errp) ||
+        !nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
     }
 out:
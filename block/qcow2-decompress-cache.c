@@ -0,0 +1,224 @@
+/*
+ * Cache of decompressed clusters for the QCOW2 format
+ *
+ * Reading from a compressed cluster requires decompressing all of it, so
+ * without a cache a guest that reads a compressed cluster in small chunks
+ * decompresses it once per request.  Clusters are kept in LRU order and
+ * looked up by the host offset of their compressed data.
+ *
+ * Compressed data is never rewritten in place: a guest write allocates a
+ * new cluster and updates the L2 entry, so the old cache entry is simply no
+ * longer looked up.  The host clusters can however be reused once they are
+ * freed, which is why update_refcount() discards the entries covering any
+ * cluster whose refcount drops to zero.  To make this cheap, entries are
+ * also indexed by the host clusters that their compressed data touches.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DecompressedCluster {
+    uint64_t coffset;   /* host offset of the compressed data */
+    int csize;          /* size of the compressed data in bytes */
+    void *data;
+    QTAILQ_ENTRY(Qcow2DecompressedCluster) next;
+} Qcow2DecompressedCluster;
+
+/* The cached clusters whose compressed data touches one host cluster */
+typedef struct Qcow2DecompressHostCluster {
+    uint64_t index;     /* host offset >> cluster_bits */
+    GSList *entries;
+} Qcow2DecompressHostCluster;
+
+struct Qcow2DecompressCache {
+    GHashTable *entries;
+    /* Qcow2DecompressHostCluster by host cluster index */
+    GHashTable *host_clusters;
+    int cluster_bits;
+    /* most recently used entries first */
+    QTAILQ_HEAD(, Qcow2DecompressedCluster) lru;
+    int nb_entries;
+    int max_entries;
+    /* incremented whenever entries are discarded */
+    uint64_t generation;
+};
+
+Qcow2DecompressCache *qcow2_decompress_cache_create(int num_clusters,
+                                                    int cluster_bits)
+{
+    Qcow2DecompressCache *c;
+
+    assert(num_clusters > 0);
+
+    c = g_new0(Qcow2DecompressCache, 1);
+    c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->host_clusters = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+    c->cluster_bits = cluster_bits;
+    QTAILQ_INIT(&c->lru);
+    c->max_entries = num_clusters;
+
+    return c;
+}
+
+/* The index of the last host cluster that the compressed data touches */
+static uint64_t last_host_cluster(Qcow2DecompressCache *c,
+                                  Qcow2DecompressedCluster *entry)
+{
+    return (entry->coffset + entry->csize - 1) >> c->cluster_bits;
+}
+
+static void qcow2_decompress_cache_remove(Qcow2DecompressCache *c,
+                                          Qcow2DecompressedCluster *entry)
+{
+    uint64_t i;
+
+    for (i = entry->coffset >> c->cluster_bits;
+         i <= last_host_cluster(c, entry); i++) {
+        Qcow2DecompressHostCluster *hc;
+
+        hc = g_hash_table_lookup(c->host_clusters, &i);
+        hc->entries = g_slist_remove(hc->entries, entry);
+        if (!hc->entries) {
+            g_hash_table_remove(c->host_clusters, &hc->index);
+        }
+    }
+
+    g_hash_table_remove(c->entries, &entry->coffset);
+    QTAILQ_REMOVE(&c->lru, entry, next);
+    c->nb_entries--;
+
+    qemu_vfree(entry->data);
+    g_free(entry);
+}
+
+void qcow2_decompress_cache_empty(Qcow2DecompressCache *c)
+{
+    Qcow2DecompressedCluster *entry, *next_entry;
+
+    QTAILQ_FOREACH_SAFE(entry, &c->lru, next, next_entry) {
+        qcow2_decompress_cache_remove(c, entry);
+    }
+    c->generation++;
+}
+
+void qcow2_decompress_cache_destroy(Qcow2DecompressCache *c)
+{
+    qcow2_decompress_cache_empty(c);
+    g_hash_table_destroy(c->host_clusters);
+    g_hash_table_destroy(c->entries);
+    g_free(c);
+}
+
+/*
+ * Returns the decompressed contents of the compressed cluster whose data
+ * starts at @coffset and spans @csize bytes, or NULL if it is not cached.
+ * The buffer is only valid until the next call that can yield.
+ */
+const void *qcow2_decompress_cache_lookup(Qcow2DecompressCache *c,
+                                          uint64_t coffset, int csize)
+{
+    Qcow2DecompressedCluster *entry;
+
+    entry = g_hash_table_lookup(c->entries, &coffset);
+    if (!entry || entry->csize != csize) {
+        return NULL;
+    }
+
+    QTAILQ_REMOVE(&c->lru, entry, next);
+    QTAILQ_INSERT_HEAD(&c->lru, entry, next);
+
+    return entry->data;
+}
+
+/*
+ * Callers take the generation before reading the compressed data and pass
+ * it to qcow2_decompress_cache_insert(), so that data that was freed while
+ * the read was in flight is not cached.
+ */
+uint64_t qcow2_decompress_cache_generation(Qcow2DecompressCache *c)
+{
+    return c->generation;
+}
+
+/*
+ * Adds the decompressed cluster @data, allocated with qemu_blockalign(), to
+ * the cache, evicting the least recently used entry if the cache is full.
+ *
+ * Returns true if the cache took ownership of @data.
+ */
+bool qcow2_decompress_cache_insert(Qcow2DecompressCache *c,
+                                   uint64_t coffset, int csize,
+                                   uint64_t generation, void *data)
+{
+    Qcow2DecompressedCluster *entry;
+    uint64_t i;
+
+    if (generation != c->generation ||
+        g_hash_table_contains(c->entries, &coffset)) {
+        return false;
+    }
+
+    if (c->nb_entries >= c->max_entries) {
+        qcow2_decompress_cache_remove(c, QTAILQ_LAST(&c->lru));
+    }
+
+    entry = g_new(Qcow2DecompressedCluster, 1);
+    *entry = (Qcow2DecompressedCluster) {
+        .coffset = coffset,
+        .csize = csize,
+        .data = data,
+    };
+    g_hash_table_insert(c->entries, &entry->coffset, entry);
+    QTAILQ_INSERT_HEAD(&c->lru, entry, next);
+    c->nb_entries++;
+
+    for (i = entry->coffset >> c->cluster_bits;
+         i <= last_host_cluster(c, entry); i++) {
+        Qcow2DecompressHostCluster *hc;
+
+        hc = g_hash_table_lookup(c->host_clusters, &i);
+        if (!hc) {
+            hc = g_new(Qcow2DecompressHostCluster, 1);
+            *hc = (Qcow2DecompressHostCluster) { .index = i };
+            g_hash_table_insert(c->host_clusters, &hc->index, hc);
+        }
+        hc->entries = g_slist_prepend(hc->entries, entry);
+    }
+
+    return true;
+}
+
+/*
+ * Discards the entries whose compressed data overlaps the given range of
+ * host clusters.  @offset and @length must be cluster aligned.
+ */
+void qcow2_decompress_cache_discard(Qcow2DecompressCache *c,
+                                    uint64_t offset, uint64_t length)
+{
+    uint64_t i;
+
+    assert(QEMU_IS_ALIGNED(offset | length, 1ULL << c->cluster_bits));
+
+    c->generation++;
+    if (!c->nb_entries) {
+        return;
+    }
+
+    for (i = offset >> c->cluster_bits;
+         i < (offset + length) >> c->cluster_bits; i++) {
+        Qcow2DecompressHostCluster *hc;
+
+        while ((hc = g_hash_table_lookup(c->host_clusters, &i))) {
+            Qcow2DecompressedCluster *entry = hc->entries->data;
+
+            trace_qcow2_decompress_cache_discard(entry->coffset);
+            qcow2_decompress_cache_remove(c, entry);
+        }
+    }
+}
@@ -133,6 +133,7 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     g_free(s->refcount_table);
+    qcow2_drop_free_cluster_map(bs);
 }
 
 
@@ -282,6 +283,129 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
     return 0;
 }
 
+/*
+ * Must be called whenever the refcount of a cluster changes from zero to
+ * non-zero or back, so that the free cluster map stays accurate.
+ */
+static void update_free_cluster_map(BDRVQcow2State *s, int64_t cluster_index,
+                                    bool in_use)
+{
+    HBitmap *map = s->free_cluster_map;
+
+    if (!map) {
+        return;
+    }
+
+    if (cluster_index >= s->free_cluster_map_size) {
+        uint64_t old_size = s->free_cluster_map_size;
+        uint64_t new_size;
+
+        if (!in_use) {
+            return;
+        }
+        new_size = MAX(ROUND_UP(cluster_index + 1, s->refcount_block_size),
+                       old_size * 2);
+        hbitmap_truncate(map, new_size);
+        hbitmap_set(map, old_size, new_size - old_size);
+        s->free_cluster_map_size = new_size;
+    }
+
+    if (in_use) {
+        hbitmap_reset(map, cluster_index, 1);
+    } else {
+        hbitmap_set(map, cluster_index, 1);
+    }
+}
+
+/*
+ * Forgets the free cluster map, which is rebuilt on the next allocation.
+ * Used when the refcount structures are replaced as a whole.
+ */
+void qcow2_drop_free_cluster_map(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->free_cluster_map) {
+        hbitmap_free(s->free_cluster_map);
+        s->free_cluster_map = NULL;
+        s->free_cluster_map_size = 0;
+    }
+}
+
+/*
+ * Reads all refcount blocks once to build s->free_cluster_map.  It only
+ * covers the clusters described by the last used reftable entry, everything
+ * past that is free.
+ */
+static int build_free_cluster_map(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t i, j, nb_reftable_entries = 0, nb_clusters;
+    HBitmap *map;
+    int ret;
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        if (s->refcount_table[i] & REFT_OFFSET_MASK) {
+            nb_reftable_entries = i + 1;
+        }
+    }
+    nb_clusters = MAX(nb_reftable_entries, 1) << s->refcount_block_bits;
+
+    map = hbitmap_alloc(nb_clusters, 0);
+    hbitmap_set(map, 0, nb_clusters);
+
+    for (i = 0; i < nb_reftable_entries; i++) {
+        uint64_t refblock_offset = s->refcount_table[i] & REFT_OFFSET_MASK;
+        uint64_t first_cluster = i << s->refcount_block_bits;
+        int64_t run_start = -1;
+        void *refblock;
+
+        if (!refblock_offset) {
+            continue;
+        }
+
+        if (offset_into_cluster(s, refblock_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", refblock_offset, i);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = qcow2_cache_get(bs, s->refcount_block_cache, refblock_offset,
+                              &refblock);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Clear runs of used clusters at once */
+        for (j = 0; j < s->refcount_block_size; j++) {
+            bool in_use = s->get_refcount(refblock, j) != 0;
+
+            if (in_use && run_start < 0) {
+                run_start = j;
+            } else if (!in_use && run_start >= 0) {
+                hbitmap_reset(map, first_cluster + run_start, j - run_start);
+                run_start = -1;
+            }
+        }
+        if (run_start >= 0) {
+            hbitmap_reset(map, first_cluster + run_start, j - run_start);
+        }
+
+        qcow2_cache_put(s->refcount_block_cache, &refblock);
+    }
+
+    trace_qcow2_build_free_cluster_map(bs, nb_clusters, hbitmap_count(map));
+    s->free_cluster_map = map;
+    s->free_cluster_map_size = nb_clusters;
+    return 0;
+
+fail:
+    hbitmap_free(map);
+    return ret;
+}
+
 /* Checks if two offsets are described by the same refcount block */
 static int in_same_refcount_block(BDRVQcow2State *s, uint64_t offset_a,
     uint64_t offset_b)
@@ -397,6 +521,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        update_free_cluster_map(s, new_block >> s->cluster_bits, true);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -657,6 +782,8 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t start_offset,
                 /* The caller guaranteed us this space would be empty */
                 assert(s->get_refcount(refblock_data, j) == 0);
                 s->set_refcount(refblock_data, j, 1);
+                update_free_cluster_map(s, (first_offset_covered >>
+                                            s->cluster_bits) + j, true);
             }
 
             qcow2_cache_entry_mark_dirty(s->refcount_block_cache,
@@ -836,7 +963,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         cluster_offset += s->cluster_size)
     {
         int block_index;
-        uint64_t refcount;
+        uint64_t refcount, old_refcount;
         int64_t cluster_index = cluster_offset >> s->cluster_bits;
         int64_t table_index = cluster_index >> s->refcount_block_bits;
 
@@ -864,7 +991,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         /* we can update the count and save it */
         block_index = cluster_index & (s->refcount_block_size - 1);
 
-        refcount = s->get_refcount(refcount_block, block_index);
+        refcount = old_refcount = s->get_refcount(refcount_block, block_index);
         if (decrease ? (refcount - addend > refcount)
                      : (refcount + addend < refcount ||
                         refcount + addend > s->refcount_max))
@@ -881,6 +1008,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        if (!old_refcount != !refcount) {
+            update_free_cluster_map(s, cluster_index, refcount != 0);
+        }
 
         if (refcount == 0) {
             void *table;
@@ -897,6 +1027,13 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            /* The cluster may be reused for new compressed data */
+            if (s->decompress_cache) {
+                qcow2_decompress_cache_discard(s->decompress_cache,
+                                               cluster_offset,
+                                               s->cluster_size);
+            }
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -965,7 +1102,7 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
                                     uint64_t max)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t nb_clusters, cluster_index;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -973,19 +1110,37 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
         qcow2_process_discards(bs, 0);
     }
 
-    nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
-
+    if (!s->free_cluster_map) {
+        ret = build_free_cluster_map(bs);
         if (ret < 0) {
             return ret;
-        } else if (refcount != 0) {
-            goto retry;
         }
     }
 
+    /* Take the first run of free clusters that is long enough */
+    nb_clusters = size_to_clusters(s, size);
+    cluster_index = s->free_cluster_index;
+    while (cluster_index < s->free_cluster_map_size) {
+        HBitmapIter hbi;
+        int64_t first_free, next_used;
+
+        hbitmap_iter_init(&hbi, s->free_cluster_map, cluster_index);
+        first_free = hbitmap_iter_next(&hbi);
+        if (first_free < 0) {
+            cluster_index = s->free_cluster_map_size;
+            break;
+        }
+
+        next_used = hbitmap_next_zero(s->free_cluster_map, first_free,
+                                      nb_clusters);
+        if (next_used < 0) {
+            cluster_index = first_free;
+            break;
+        }
+        cluster_index = next_used + 1;
+    }
+    s->free_cluster_index = cluster_index + nb_clusters;
+
     /* Make sure that all offsets in the "allocated" range are representable
      * in the requested max */
     if (s->free_cluster_index > 0 &&
@@ -1253,7 +1408,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1309,7 +1464,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1383,7 +1538,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1599,12 +1754,12 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t *l2_table, l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * l2_entry_size(s);
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
@@ -1616,10 +1771,30 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint32_t alloc = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+            uint32_t zero = l2_bitmap >> 32;
+
+            if (alloc & zero) {
+                fprintf(stderr, "ERROR: subclusters of cluster %d are both "
+                        "allocated and zero, bitmap=0x%" PRIx64 "\n",
+                        i, l2_bitmap);
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(bs, l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
+            if (l2_bitmap) {
+                fprintf(stderr, "ERROR compressed cluster %d with non-zero "
+                        "subcluster allocation bitmap, entry=0x%" PRIx64 "\n",
+                        i, l2_entry);
+                res->corruptions++;
+            }
+
             /* Compressed clusters don't have QCOW_OFLAG_COPIED */
             if (l2_entry & QCOW_OFLAG_COPIED) {
                 fprintf(stderr, "ERROR: coffset=0x%" PRIx64 ": "
@@ -1679,13 +1854,14 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
                             offset);
                     if (fix & BDRV_FIX_ERRORS) {
+                        int idx = i * (l2_entry_size(s) / sizeof(uint64_t));
                         uint64_t l2e_offset =
-                            l2_offset + (uint64_t)i * sizeof(uint64_t);
+                            l2_offset + (uint64_t)i * l2_entry_size(s);
                         int ign = active ? QCOW2_OL_ACTIVE_L2 :
                                            QCOW2_OL_INACTIVE_L2;
 
                         l2_entry = QCOW_OFLAG_ZERO;
-                        l2_table[i] = cpu_to_be64(l2_entry);
+                        set_l2_entry(s, l2_table, i, l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs, ign,
                                 l2e_offset, sizeof(uint64_t), false);
                         if (ret < 0) {
@@ -1697,7 +1873,8 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
-                                               &l2_table[i], sizeof(uint64_t));
+                                               &l2_table[idx],
+                                               sizeof(uint64_t));
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Failed to overwrite L2 "
                                     "table entry: %s\n", strerror(-ret));
@@ -1740,7 +1917,15 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         case QCOW2_CLUSTER_ZERO_PLAIN:
+            break;
+
         case QCOW2_CLUSTER_UNALLOCATED:
+            if (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) {
+                fprintf(stderr, "ERROR: unallocated cluster %d has non-zero "
+                        "subcluster allocation bitmap, bitmap=0x%" PRIx64 "\n",
+                        i, l2_bitmap);
+                res->corruptions++;
+            }
             break;
 
         default:
@@ -1904,7 +2089,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1913,7 +2098,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
@@ -1936,9 +2121,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             repair ? "Repairing" : "ERROR", l2_entry, refcount);
                     if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty++;
                     }
                 }
@@ -2352,6 +2537,7 @@ static int rebuild_refcount_structure(BlockDriverState *bs,
     } QEMU_PACKED reftable_offset_and_clusters;
 
     qcow2_cache_empty(bs, s->refcount_block_cache);
+    qcow2_drop_free_cluster_map(bs);
 
 write_refblocks:
     for (; cluster < *nb_clusters; cluster++) {
@@ -2518,6 +2704,33 @@ fail:
     return ret;
 }
 
+/*
+ * Cross-checks s->free_cluster_map against the refcounts.  The map only
+ * mirrors the refcount blocks, so any mismatch is a bug in the code that
+ * maintains it rather than corruption in the image.
+ */
+static void check_free_cluster_map(BlockDriverState *bs, int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t i;
+
+    if (!s->free_cluster_map) {
+        return;
+    }
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t refcount;
+        bool is_free;
+
+        if (qcow2_get_refcount(bs, i, &refcount) < 0) {
+            continue;
+        }
+        is_free = i >= s->free_cluster_map_size ||
+                  hbitmap_get(s->free_cluster_map, i);
+        assert(is_free == (refcount == 0));
+    }
+}
+
 /*
  * Checks an image for refcount consistency.
  *
@@ -2562,6 +2775,19 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     compare_refcounts(bs, res, 0, &rebuild, &highest_cluster, refcount_table,
                       nb_clusters);
 
+    /*
+     * If the refcount structure is sane, build the free cluster map now so
+     * that the repairs below have to keep it up to date; it is checked
+     * against the refcounts at the end.
+     */
+    if (!rebuild && !s->free_cluster_map) {
+        ret = build_free_cluster_map(bs);
+        if (ret < 0) {
+            res->check_errors++;
+            goto fail;
+        }
+    }
+
     if (rebuild && (fix & BDRV_FIX_ERRORS)) {
         BdrvCheckResult old_res = *res;
         int fresh_leaks = 0;
@@ -2635,6 +2861,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         goto fail;
     }
 
+    check_free_cluster_map(bs, nb_clusters);
+
     res->image_end_offset = (highest_cluster + 1) * s->cluster_size;
     ret = 0;
 
@@ -3252,6 +3480,7 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
 
     s->get_refcount = new_get_refcount;
     s->set_refcount = new_set_refcount;
+    qcow2_drop_free_cluster_map(bs);
 
     /* For cleaning up all old refblocks and the old reftable below the "done"
      * label */
@@ -3340,6 +3569,7 @@ static int qcow2_discard_refcount_block(BlockDriverState *bs,
         return -EINVAL;
     }
     s->set_refcount(refblock, block_index, 0);
+    update_free_cluster_map(s, cluster_index, false);
 
     qcow2_cache_entry_mark_dirty(s->refcount_block_cache, refblock);
 
@@ -18,6 +18,7 @@
 #include "block/nbd.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
+#include "sysemu/iothread.h"
 
 typedef struct NBDServerData {
     QIONetListener *listener;
@@ -132,6 +133,11 @@ void nbd_server_start(SocketAddress *addr, const char *tls_creds,
     nbd_server = NULL;
 }
 
+void nbd_server_start_options(NbdServerOptions *arg, Error **errp)
+{
+    nbd_server_start(arg->addr, arg->tls_creds, arg->tls_authz, errp);
+}
+
 void qmp_nbd_server_start(SocketAddressLegacy *addr,
                           bool has_tls_creds, const char *tls_creds,
                           bool has_tls_authz, const char *tls_authz,
@@ -145,13 +151,16 @@ void qmp_nbd_server_start(SocketAddressLegacy *addr,
 
 void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
                         bool has_writable, bool writable,
-                        bool has_bitmap, const char *bitmap, Error **errp)
+                        bool has_bitmap, const char *bitmap,
+                        bool has_iothread, const char *iothread,
+                        Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
     NBDExport *exp;
     int64_t len;
     AioContext *aio_context;
+    AioContext *new_context = NULL;
 
     if (!nbd_server) {
         error_setg(errp, "NBD server not running");
@@ -179,8 +188,27 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         return;
     }
 
+    if (has_iothread) {
+        IOThread *obj = iothread_by_id(iothread);
+        if (!obj) {
+            error_setg(errp, "Cannot find iothread %s", iothread);
+            return;
+        }
+        new_context = iothread_get_aio_context(obj);
+    }
+
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
+
+    if (new_context && new_context != aio_context) {
+        if (bdrv_try_set_aio_context(bs, new_context, errp) < 0) {
+            goto out;
+        }
+        aio_context_release(aio_context);
+        aio_context = new_context;
+        aio_context_acquire(aio_context);
+    }
+
     len = bdrv_getlength(bs);
     if (len < 0) {
         error_setg_errno(errp, -len,
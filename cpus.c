@@ -28,6 +28,7 @@
 #include "migration/vmstate.h"
 #include "monitor/monitor.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qapi/qapi-events-run-state.h"
 #include "qapi/qmp/qerror.h"
@@ -59,6 +60,8 @@
 #include "sysemu/runstate.h"
 #include "hw/boards.h"
 #include "hw/hw.h"
+#include "qemu/units.h"
+#include "trace-root.h"
 
 #ifdef CONFIG_LINUX
 
@@ -87,6 +90,12 @@ int64_t max_advance;
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
 
+/* Dirty rates are measured over this period for cpu_dirty_limit_set() */
+#define DIRTY_LIMIT_CALC_PERIOD_NS (1000 * SCALE_MS)
+
+static QEMUTimer *dirty_limit_timer;
+static int64_t dirty_limit_calc_time;
+
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
 #define CPU_THROTTLE_TIMESLICE_NS 10000000
@@ -709,20 +718,10 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
-static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
+static void cpu_throttle_sleep(CPUState *cpu, int64_t sleeptime_ns)
 {
-    double pct;
-    double throttle_ratio;
-    int64_t sleeptime_ns, endtime_ns;
-
-    if (!cpu_throttle_get_percentage()) {
-        return;
-    }
+    int64_t endtime_ns;
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    /* Add 1ns to fix double's rounding error (like 0.9999999...) */
-    sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
     endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
     while (sleeptime_ns > 0 && !cpu->stop) {
         if (sleeptime_ns > SCALE_MS) {
@@ -735,6 +734,23 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
         }
         sleeptime_ns = endtime_ns - qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     }
+}
+
+static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
+{
+    double pct;
+    double throttle_ratio;
+    int64_t sleeptime_ns;
+
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+
+    pct = (double)cpu_throttle_get_percentage()/100;
+    throttle_ratio = pct / (1 - pct);
+    /* Add 1ns to fix double's rounding error (like 0.9999999...) */
+    sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
+    cpu_throttle_sleep(cpu, sleeptime_ns);
     atomic_set(&cpu->throttle_thread_scheduled, 0);
 }
 
@@ -786,6 +802,114 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+static void cpu_dirty_limit_thread(CPUState *cpu, run_on_cpu_data opaque)
+{
+    int pct = atomic_read(&cpu->dirty_limit_pct);
+
+    /*
+     * The timer runs every CPU_THROTTLE_TIMESLICE_NS, so sleeping for pct%
+     * of it leaves the vcpu running for the rest of the slice.
+     */
+    cpu_throttle_sleep(cpu, (int64_t)pct * CPU_THROTTLE_TIMESLICE_NS / 100);
+    atomic_set(&cpu->dirty_limit_scheduled, 0);
+}
+
+/*
+ * Measure the dirty rate of @cpu and pick the sleep percentage that should
+ * bring it to the limit, assuming that the rate is proportional to the time
+ * the vcpu runs.  Move only halfway there each period to avoid oscillating.
+ */
+static void cpu_dirty_limit_update(CPUState *cpu, int64_t period_ns)
+{
+    uint32_t pages = atomic_read(&cpu->dirty_pages);
+    double rate, target;
+    int pct = cpu->dirty_limit_pct;
+
+    rate = (double)(uint32_t)(pages - cpu->dirty_pages_prev) *
+           TARGET_PAGE_SIZE / MiB * NANOSECONDS_PER_SECOND / period_ns;
+    cpu->dirty_pages_prev = pages;
+    cpu->dirty_rate = rate;
+
+    if (rate > 0) {
+        target = 100 - (double)cpu->dirty_limit * (100 - pct) / rate;
+    } else {
+        target = 0;
+    }
+    target = MIN(target, CPU_THROTTLE_PCT_MAX);
+    target = MAX(target, 0);
+    if (target > pct) {
+        pct = (pct + (int)target + 1) / 2;
+    } else {
+        pct = (pct + (int)target) / 2;
+    }
+
+    trace_cpu_dirty_limit_update(cpu->cpu_index, cpu->dirty_limit,
+                                 cpu->dirty_rate, pct);
+    atomic_set(&cpu->dirty_limit_pct, pct);
+}
+
+static void cpu_dirty_limit_timer_tick(void *opaque)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT);
+    int64_t period_ns = now - dirty_limit_calc_time;
+    bool calc = period_ns >= DIRTY_LIMIT_CALC_PERIOD_NS;
+    bool limited = false;
+    CPUState *cpu;
+
+    if (calc) {
+        if (kvm_dirty_ring_enabled()) {
+            kvm_dirty_ring_collect();
+        }
+        dirty_limit_calc_time = now;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (!cpu->dirty_limit) {
+            continue;
+        }
+        limited = true;
+        if (calc) {
+            cpu_dirty_limit_update(cpu, period_ns);
+        }
+        if (cpu->dirty_limit_pct &&
+            !atomic_xchg(&cpu->dirty_limit_scheduled, 1)) {
+            async_run_on_cpu(cpu, cpu_dirty_limit_thread, RUN_ON_CPU_NULL);
+        }
+    }
+
+    /* Stop the timer if needed */
+    if (limited) {
+        timer_mod(dirty_limit_timer, now + CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+bool cpu_dirty_limit_supported(void)
+{
+    return tcg_enabled() || kvm_dirty_ring_enabled();
+}
+
+void cpu_dirty_limit_set(CPUState *cpu, uint64_t rate)
+{
+    bool was_limited = cpu->dirty_limit;
+
+    cpu->dirty_limit = rate;
+    if (!rate) {
+        cpu->dirty_rate = 0;
+        atomic_set(&cpu->dirty_limit_pct, 0);
+        return;
+    }
+    if (was_limited) {
+        return;
+    }
+
+    cpu->dirty_pages_prev = atomic_read(&cpu->dirty_pages);
+    if (!timer_pending(dirty_limit_timer)) {
+        dirty_limit_calc_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT);
+        timer_mod(dirty_limit_timer,
+                  dirty_limit_calc_time + CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock);
@@ -793,6 +917,8 @@ void cpu_ticks_init(void)
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
     throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
                                            cpu_throttle_timer_tick, NULL);
+    dirty_limit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
+                                     cpu_dirty_limit_timer_tick, NULL);
 }
 
 void configure_icount(QemuOpts *opts, Error **errp)
@@ -2253,6 +2379,103 @@ void qmp_inject_nmi(Error **errp)
     nmi_monitor_handle(monitor_get_cpu_index(), errp);
 }
 
+static CPUState *dirty_limit_get_cpu(bool has_cpu_index, int64_t cpu_index,
+                                     Error **errp)
+{
+    CPUState *cpu;
+
+    if (!cpu_dirty_limit_supported()) {
+        error_setg(errp, "Dirty page rate limits require TCG, or KVM with "
+                   "the dirty ring enabled (dirty-ring-size)");
+        return NULL;
+    }
+    if (!has_cpu_index) {
+        return NULL;
+    }
+
+    cpu = cpu_index == (int)cpu_index ? qemu_get_cpu(cpu_index) : NULL;
+    if (!cpu) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
+                   "a CPU number");
+    }
+    return cpu;
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                              uint64_t dirty_rate, Error **errp)
+{
+    Error *local_err = NULL;
+    CPUState *cpu;
+
+    cpu = dirty_limit_get_cpu(has_cpu_index, cpu_index, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (!dirty_rate) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "dirty-rate",
+                   "a value greater than zero");
+        return;
+    }
+
+    if (cpu) {
+        cpu_dirty_limit_set(cpu, dirty_rate);
+    } else {
+        CPU_FOREACH(cpu) {
+            cpu_dirty_limit_set(cpu, dirty_rate);
+        }
+    }
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    Error *local_err = NULL;
+    CPUState *cpu;
+
+    cpu = dirty_limit_get_cpu(has_cpu_index, cpu_index, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (cpu) {
+        cpu_dirty_limit_set(cpu, 0);
+    } else {
+        CPU_FOREACH(cpu) {
+            cpu_dirty_limit_set(cpu, 0);
+        }
+    }
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    DirtyLimitInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        DirtyLimitInfoList *entry;
+        DirtyLimitInfo *info;
+
+        if (!cpu->dirty_limit) {
+            continue;
+        }
+
+        info = g_new0(DirtyLimitInfo, 1);
+        info->cpu_index = cpu->cpu_index;
+        info->limit_rate = cpu->dirty_limit;
+        info->current_rate = cpu->dirty_rate;
+        info->throttle_percentage = atomic_read(&cpu->dirty_limit_pct);
+
+        entry = g_new0(DirtyLimitInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 void dump_drift_info(void)
 {
     if (!use_icount) {
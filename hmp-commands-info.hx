@@ -608,6 +608,36 @@ STEXI
 @item info migrate_cache_size
 @findex info migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show dirty page rate measured by calc_dirty_rate",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex info dirty_rate
+Show the dirty page rate measured by @code{calc_dirty_rate}.
+ETEXI
+
+    {
+        .name       = "migrate_timings",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the time spent in each phase of the last "
+                      "migration",
+        .cmd        = hmp_info_migrate_timings,
+    },
+
+STEXI
+@item info migrate_timings
+@findex info migrate_timings
+Show the time spent in each phase of the last outgoing and incoming
+migration, and on each device.
 ETEXI
 
     {
@@ -1082,6 +1082,24 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:l,sample_pages:l?",
+        .params     = "second [sample_pages]",
+        .help       = "start measuring the guest dirty page rate over "
+                      "'second' seconds, sampling 'sample_pages' pages "
+                      "per GiB of guest memory (default 512)",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties memory over @var{second}
+seconds, without starting a migration.  @var{sample_pages} pages are sampled
+per GiB of guest memory.  Use @code{info dirty_rate} to get the result.
 ETEXI
 
     {
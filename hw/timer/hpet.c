@@ -334,6 +334,12 @@ static const VMStateDescription vmstate_hpet = {
     .pre_save = hpet_pre_save,
     .pre_load = hpet_pre_load,
     .post_load = hpet_post_load,
+    /*
+     * hpet_post_load only writes the HPETState and this HPET's own slot of
+     * hpet_cfg, and reads the virtual clock, which is fine without the BQL.
+     * Nothing else loaded at the same priority looks at those fields.
+     */
+    .threaded_post_load = true,
     .fields = (VMStateField[]) {
         VMSTATE_UINT64(config, HPETState),
         VMSTATE_UINT64(isr, HPETState),
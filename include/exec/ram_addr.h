@@ -62,6 +62,14 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * Mapped-ram migration: bitmap of the pages present in the file, and
+     * where the bitmap and the pages of this block are in the file.
+     */
+    unsigned long *file_bmap;
+    int64_t bitmap_offset;
+    int64_t pages_offset;
 };
 
 /**
@@ -0,0 +1,52 @@
+/*
+ * Persistent translation block cache for user-mode emulation
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#ifndef EXEC_TB_CACHE_H
+#define EXEC_TB_CACHE_H
+
+#include "exec/exec-all.h"
+
+#ifdef CONFIG_USER_ONLY
+/*
+ * The cache stores the used part of code_gen_buffer together with the
+ * guest code each TB was translated from.  It is only reused when the
+ * host code would be bit-for-bit identical: same QEMU binary loaded at
+ * the same address, same code_gen_buffer placement and same guest_base.
+ * Every cached TB is revalidated against the current guest memory before
+ * tb_gen_code() hands it out instead of translating, and must still be
+ * mapped executable.  Cache files that could have been written by other
+ * users are ignored.
+ */
+void tb_cache_init(const char *dir);
+bool tb_cache_enabled(void);
+void tb_cache_load(const char *exec_path, const char *cpu_model,
+                   const char *cpu_type);
+void tb_cache_save(void);
+void tb_cache_flush(void);
+TranslationBlock *tb_cache_lookup(CPUState *cpu, target_ulong pc,
+                                  target_ulong cs_base, uint32_t flags,
+                                  uint32_t cflags);
+#else
+static inline bool tb_cache_enabled(void)
+{
+    return false;
+}
+
+static inline void tb_cache_flush(void)
+{
+}
+
+static inline TranslationBlock *tb_cache_lookup(CPUState *cpu,
+                                                target_ulong pc,
+                                                target_ulong cs_base,
+                                                uint32_t flags,
+                                                uint32_t cflags)
+{
+    return NULL;
+}
+#endif
+
+#endif /* EXEC_TB_CACHE_H */
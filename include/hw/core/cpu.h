@@ -263,6 +263,7 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
@@ -412,6 +413,8 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -436,6 +439,17 @@ struct CPUState {
      */
     bool throttle_thread_scheduled;
 
+    /*
+     * Pages dirtied by this vcpu while dirty tracking is enabled, and the
+     * state of its dirty rate limit, see cpu_dirty_limit_set()
+     */
+    uint32_t dirty_pages;
+    uint32_t dirty_pages_prev;
+    uint64_t dirty_limit;
+    uint64_t dirty_rate;
+    int dirty_limit_pct;
+    bool dirty_limit_scheduled;
+
     bool ignore_memory_transaction_failures;
 
     struct hax_vcpu_state *hax_vcpu;
@@ -856,6 +870,29 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_dirty_limit_set:
+ * @cpu: The vCPU to limit.
+ * @rate: Dirty page rate limit in MB/s, or 0 to remove the limit.
+ *
+ * Throttles @cpu, and only @cpu, whenever it dirties guest memory faster
+ * than @rate.  The dirty rate is measured every second, and the vCPU is
+ * made to sleep for the fraction of time that should bring it down to
+ * the limit, in the same way as cpu_throttle_set() does for all vCPUs.
+ *
+ * Dirty pages can only be attributed to a vCPU with TCG and with the KVM
+ * dirty ring, and only while dirty tracking is enabled, e.g. during
+ * migration.
+ */
+void cpu_dirty_limit_set(CPUState *cpu, uint64_t rate);
+
+/**
+ * cpu_dirty_limit_supported:
+ *
+ * Returns: %true if the accelerator can attribute dirty pages to vCPUs.
+ */
+bool cpu_dirty_limit_supported(void);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
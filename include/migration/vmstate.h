@@ -182,6 +182,14 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * Let the incoming side run post_load on a worker thread, without the
+     * BQL, while it goes on loading other devices.  It is waited for
+     * before any device of lower priority is loaded, so only set this if
+     * no other device of the same priority depends on this post_load, and
+     * post_load does not touch state shared with other devices.
+     */
+    bool threaded_post_load;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
@@ -1171,6 +1179,9 @@ extern const VMStateInfo vmstate_info_qlist;
 
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id);
+int vmstate_load_state_no_post_load(QEMUFile *f,
+                                    const VMStateDescription *vmsd,
+                                    void *opaque, int version_id);
 int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, QJSON *vmdesc);
 int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
@@ -2,6 +2,7 @@
 #define MONITOR_H
 
 #include "block/block.h"
+#include "qapi/qapi-types-control.h"
 #include "qapi/qapi-types-misc.h"
 #include "qemu/readline.h"
 
@@ -16,6 +17,8 @@ void monitor_init_globals(void);
 void monitor_init_globals_core(void);
 void monitor_init_qmp(Chardev *chr, bool pretty);
 void monitor_init_hmp(Chardev *chr, bool use_readline);
+int monitor_init(MonitorOptions *opts, bool allow_hmp, Error **errp);
+int monitor_init_opts(QemuOpts *opts, Error **errp);
 void monitor_cleanup(void);
 
 int monitor_suspend(Monitor *mon);
@@ -42,5 +45,6 @@ int monitor_fdset_get_fd(int64_t fdset_id, int flags);
 int monitor_fdset_dup_fd_add(int64_t fdset_id, int dup_fd);
 void monitor_fdset_dup_fd_remove(int dup_fd);
 int64_t monitor_fdset_dup_fd_find(int dup_fd);
+void monitor_fdsets_cleanup(void);
 
 #endif /* MONITOR_H */
@@ -0,0 +1,34 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef USERFAULTFD_H
+#define USERFAULTFD_H
+
+#ifdef CONFIG_LINUX
+
+#include <linux/userfaultfd.h>
+
+/* Returns the features supported by the kernel in @features, or -1 */
+int uffd_query_features(uint64_t *features);
+/* Returns a new userfaultfd with @features enabled, or -1 */
+int uffd_create_fd(uint64_t features, bool non_blocking);
+void uffd_close_fd(int uffd_fd);
+int uffd_register_memory(int uffd_fd, void *addr, uint64_t length,
+                         uint64_t track_mode, uint64_t *ioctls);
+int uffd_unregister_memory(int uffd_fd, void *addr, uint64_t length);
+/*
+ * Write protect (@wp) or unprotect a range; unprotecting wakes the threads
+ * that faulted on the range unless @dont_wake is set.
+ */
+int uffd_change_protection(int uffd_fd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake);
+/* Returns the number of events read, 0 if there were none, or -1 */
+int uffd_read_events(int uffd_fd, struct uffd_msg *msgs, int count);
+
+#endif /* CONFIG_LINUX */
+
+#endif /* USERFAULTFD_H */
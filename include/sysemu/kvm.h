@@ -239,6 +239,20 @@ bool kvm_arm_supports_user_irq(void);
  */
 bool kvm_memcrypt_enabled(void);
 
+/**
+ * kvm_dirty_ring_enabled - return whether dirty pages are collected from
+ *                          per-vCPU dirty rings
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_collect - harvest the dirty rings of all vCPUs, adding
+ *                          to their CPUState::dirty_pages count
+ *
+ * Must be called with the BQL held.
+ */
+void kvm_dirty_ring_collect(void);
+
 /**
  * kvm_memcrypt_encrypt_data: encrypt the memory range
  *
@@ -37,6 +37,7 @@
 #include "sysemu/cpus.h"
 #include "sysemu/runstate.h"
 #include "net/filter.h"
+#include "timings.h"
 
 static bool vmstate_loading;
 static Notifier packets_compare_notifier;
@@ -412,6 +413,9 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     qio_channel_io_seek(QIO_CHANNEL(bioc), 0, 0, NULL);
     bioc->usage = 0;
 
+    /* Only keep the timings of the last checkpoint */
+    migration_timings_reset(false);
+
     qemu_mutex_lock_iothread();
     if (failover_get_state() != FAILOVER_STATUS_NONE) {
         qemu_mutex_unlock_iothread();
@@ -761,6 +765,9 @@ void *colo_process_incoming_thread(void *opaque)
             goto out;
         }
 
+        /* Only keep the timings of the last checkpoint */
+        migration_timings_reset(true);
+
         qemu_mutex_lock_iothread();
         vm_stop_force_state(RUN_STATE_COLO);
         trace_colo_vm_state_change("run", "stop");
@@ -0,0 +1,247 @@
+/*
+ * Dirty page rate estimation
+ *
+ * The dirty rate is estimated by hashing a random sample of the pages of
+ * each RAMBlock, hashing them again after the measurement period and
+ * counting how many changed.  The guest is not stopped and dirty logging
+ * is not enabled, so the measurement does not slow it down.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "exec/cpu-common.h"
+#include "exec/target_page.h"
+#include "sysemu/runstate.h"
+#include "dirtyrate.h"
+#include "postcopy-ram.h"
+#include "trace.h"
+
+typedef struct RAMBlockDirtyInfo {
+    char *idstr;
+    ram_addr_t length;
+    uint64_t nr_samples;
+    uint64_t *sample_pages;
+    uint32_t *hashes;
+} RAMBlockDirtyInfo;
+
+typedef struct DirtyRateSample {
+    GArray *blocks;
+    uint64_t sample_pages;
+    /* filled in by the second pass */
+    uint64_t total_bytes;
+    uint64_t nr_sampled;
+    uint64_t nr_dirty;
+} DirtyRateSample;
+
+/*
+ * The QMP commands only start a measurement when none is running, and
+ * only the measuring thread writes the results before setting the status
+ * to DIRTY_RATE_STATUS_MEASURED.
+ */
+static struct {
+    int status;
+    int64_t start_time;
+    int64_t calc_time;
+    uint64_t sample_pages;
+    int64_t dirty_rate;
+} dirtyrate;
+
+static uint32_t dirtyrate_page_hash(RAMBlock *rb, uint64_t page)
+{
+    size_t page_size = qemu_target_page_size();
+    uint8_t *host = qemu_ram_get_host_addr(rb);
+
+    return crc32(0, host + page * page_size, page_size);
+}
+
+static int dirtyrate_record_block(RAMBlock *rb, void *opaque)
+{
+    DirtyRateSample *sample = opaque;
+    RAMBlockDirtyInfo info;
+    uint64_t nr_pages, i;
+
+    if (!qemu_ram_is_migratable(rb)) {
+        return 0;
+    }
+
+    info.length = qemu_ram_get_used_length(rb);
+    nr_pages = info.length >> qemu_target_page_bits();
+    if (!nr_pages) {
+        return 0;
+    }
+
+    /* Sample at least one page of each block, however small */
+    info.nr_samples = (nr_pages * sample->sample_pages) >>
+                      (30 - qemu_target_page_bits());
+    info.nr_samples = MIN(MAX(info.nr_samples, 1), nr_pages);
+    info.idstr = g_strdup(qemu_ram_get_idstr(rb));
+    info.sample_pages = g_new(uint64_t, info.nr_samples);
+    info.hashes = g_new(uint32_t, info.nr_samples);
+
+    for (i = 0; i < info.nr_samples; i++) {
+        uint64_t rand = (uint64_t)g_random_int() << 32 | g_random_int();
+
+        info.sample_pages[i] = rand % nr_pages;
+        info.hashes[i] = dirtyrate_page_hash(rb, info.sample_pages[i]);
+    }
+
+    g_array_append_val(sample->blocks, info);
+    return 0;
+}
+
+static int dirtyrate_compare_block(RAMBlock *rb, void *opaque)
+{
+    DirtyRateSample *sample = opaque;
+    RAMBlockDirtyInfo *info = NULL;
+    uint64_t nr_dirty = 0, i;
+    uint32_t hash;
+
+    for (i = 0; i < sample->blocks->len; i++) {
+        info = &g_array_index(sample->blocks, RAMBlockDirtyInfo, i);
+        if (!strcmp(info->idstr, qemu_ram_get_idstr(rb))) {
+            break;
+        }
+        info = NULL;
+    }
+
+    /* Skip blocks that were added or resized during the measurement */
+    if (!info || info->length != qemu_ram_get_used_length(rb)) {
+        return 0;
+    }
+
+    for (i = 0; i < info->nr_samples; i++) {
+        hash = dirtyrate_page_hash(rb, info->sample_pages[i]);
+        if (hash != info->hashes[i]) {
+            nr_dirty++;
+        }
+    }
+
+    trace_dirtyrate_compare_block(info->idstr, info->nr_samples, nr_dirty);
+    sample->total_bytes += info->length;
+    sample->nr_sampled += info->nr_samples;
+    sample->nr_dirty += nr_dirty;
+    return 0;
+}
+
+static void dirtyrate_free_blocks(GArray *blocks)
+{
+    guint i;
+
+    for (i = 0; i < blocks->len; i++) {
+        RAMBlockDirtyInfo *info = &g_array_index(blocks, RAMBlockDirtyInfo, i);
+
+        g_free(info->idstr);
+        g_free(info->sample_pages);
+        g_free(info->hashes);
+    }
+    g_array_free(blocks, true);
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateSample sample = {
+        .blocks = g_array_new(false, false, sizeof(RAMBlockDirtyInfo)),
+        .sample_pages = dirtyrate.sample_pages,
+    };
+    int64_t start_ms, sleep_ms, elapsed_ms;
+    int64_t dirty_rate = 0;
+
+    rcu_register_thread();
+
+    /*
+     * Each page is hashed at about the same time into both passes, so the
+     * time between the start of the passes is the measurement period.
+     */
+    start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_ram_foreach_block(dirtyrate_record_block, &sample);
+    sleep_ms = start_ms + dirtyrate.calc_time * 1000 -
+               qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (sleep_ms > 0) {
+        g_usleep(sleep_ms * 1000);
+    }
+    elapsed_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms;
+    qemu_ram_foreach_block(dirtyrate_compare_block, &sample);
+
+    if (sample.nr_sampled && elapsed_ms > 0) {
+        dirty_rate = (double)sample.nr_dirty / sample.nr_sampled *
+                     sample.total_bytes / MiB * 1000 / elapsed_ms;
+    }
+    trace_dirtyrate_result(dirty_rate, sample.nr_sampled, sample.nr_dirty,
+                           elapsed_ms);
+
+    dirtyrate_free_blocks(sample.blocks);
+    dirtyrate.dirty_rate = dirty_rate;
+    atomic_store_release(&dirtyrate.status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    PostcopyState ps = postcopy_state_get();
+    QemuThread thread;
+
+    if (atomic_load_acquire(&dirtyrate.status) ==
+        DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "The dirty rate is already being measured");
+        return;
+    }
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between %d and %d seconds",
+                   DIRTYRATE_MIN_CALC_TIME, DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "sample-pages must be between %d and %d",
+                   DIRTYRATE_MIN_SAMPLE_PAGES, DIRTYRATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+    /* Reading RAM would fault on pages that postcopy has not received */
+    if (runstate_check(RUN_STATE_INMIGRATE) ||
+        (ps != POSTCOPY_INCOMING_NONE && ps != POSTCOPY_INCOMING_END)) {
+        error_setg(errp, "Cannot measure the dirty rate of an incoming VM");
+        return;
+    }
+
+    dirtyrate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    dirtyrate.calc_time = calc_time;
+    dirtyrate.sample_pages = sample_pages;
+    dirtyrate.status = DIRTY_RATE_STATUS_MEASURING;
+    trace_dirtyrate_start(calc_time, sample_pages);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = atomic_load_acquire(&dirtyrate.status);
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirtyrate.dirty_rate;
+    }
+    info->start_time = dirtyrate.start_time;
+    info->calc_time = dirtyrate.calc_time;
+    info->sample_pages = dirtyrate.sample_pages;
+
+    return info;
+}
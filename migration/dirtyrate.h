@@ -0,0 +1,20 @@
+/*
+ * Dirty page rate estimation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/* Default number of pages sampled per GiB of guest memory */
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES    512
+#define DIRTYRATE_MIN_SAMPLE_PAGES        1
+#define DIRTYRATE_MAX_SAMPLE_PAGES        10000
+
+/* Limits of the measurement period, in seconds */
+#define DIRTYRATE_MIN_CALC_TIME           1
+#define DIRTYRATE_MAX_CALC_TIME           60
+
+#endif
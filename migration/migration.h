@@ -43,6 +43,15 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/* Channels that incoming postcopy pages can arrive on */
+enum {
+    /* The main migration stream */
+    RAM_CHANNEL_PRECOPY = 0,
+    /* The postcopy preempt channel, only carries requested pages */
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -75,8 +84,15 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary pages that are 'placed' later, one per channel */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* RAMBlock of the last page received on each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+    /* Postcopy preempt channel and the thread that loads pages from it */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_preempt_thread;
+    QemuThread postcopy_preempt_thread;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -134,7 +150,14 @@ struct MigrationState
     /*< public >*/
     QemuThread thread;
     QEMUBH *cleanup_bh;
+    /* Restarts the VM once a background snapshot has been started */
+    QEMUBH *vm_start_bh;
     QEMUFile *to_dst_file;
+    /*
+     * Postcopy preempt channel for the pages requested by the destination;
+     * protected by qemu_file_lock like to_dst_file.
+     */
+    QEMUFile *postcopy_qemufile_src;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
      * yield or hang during the critical section, since this lock will
@@ -252,6 +275,19 @@ struct MigrationState
      */
     bool decompress_error_check;
 
+    /*
+     * Whether the multifd channel threads look for zero pages and send
+     * only their offsets.  It is left at false for qemu older than 5.0,
+     * whose receive side ignores the zero page list.
+     */
+    bool multifd_zero_page;
+
+    /*
+     * Number of threads that run the post_load of devices with
+     * threaded_post_load on the incoming side; 0 runs them inline.
+     */
+    uint8_t post_load_threads;
+
     /*
      * This decides the size of guest memory chunk that will be used
      * to track dirty bitmap clearing.  The size of memory chunk will
@@ -290,6 +326,9 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
+bool migrate_mapped_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
@@ -297,8 +336,16 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void);
+#else
+#define migrate_use_zero_copy_send() (false)
+#endif
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
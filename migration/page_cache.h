@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative; the set is chosen by the page address and
+ * the least recently used page of the set is replaced.
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -61,7 +62,12 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * If the set for @addr is full, the page in it that was least recently
+ * inserted or hit is evicted, unless it was used in the last
+ * CACHED_PAGE_LIFETIME bitmap generations.
+ *
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted to make room for it, and 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -23,6 +23,8 @@
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
@@ -539,8 +541,16 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /* It quits once the source sends the end of the preempt stream */
+        qemu_thread_join(&mis->postcopy_preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -577,9 +587,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1096,6 +1108,8 @@ retry:
 
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1134,14 +1148,16 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        mis->postcopy_tmp_pages[i] = mmap(NULL, mis->largest_page_size,
+                                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                          MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_pages[i] == MAP_FAILED) {
+            mis->postcopy_tmp_pages[i] = NULL;
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
     }
 
     /*
@@ -1353,6 +1369,93 @@ void postcopy_fault_thread_notify(MigrationIncomingState *mis)
     }
 }
 
+/* ------------------------------------------------------------------------- */
+
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc;
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS");
+        return -1;
+    }
+
+    ioc = socket_send_channel_create_sync(errp);
+    if (!ioc) {
+        return -1;
+    }
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+
+    qemu_mutex_lock(&s->qemu_file_lock);
+    s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    qemu_mutex_unlock(&s->qemu_file_lock);
+    object_unref(OBJECT(ioc));
+
+    trace_postcopy_preempt_setup();
+    return 0;
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    ret = ram_load_postcopy_preempt(mis->postcopy_qemufile_dst);
+    if (ret) {
+        /*
+         * Make sure the source notices too: the main channel then fails
+         * and postcopy recovery resends whatever got lost here.
+         */
+        error_report("%s: failed to load requested pages: %d",
+                     __func__, ret);
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
+
+/*
+ * Start loading from the preempt channel once it is connected and the
+ * userfaultfd is set up; called from the main thread on either event.
+ */
+void postcopy_preempt_thread_start(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_get();
+
+    if (!mis->postcopy_qemufile_dst || mis->have_preempt_thread ||
+        !mis->have_fault_thread ||
+        (ps != POSTCOPY_INCOMING_LISTENING &&
+         ps != POSTCOPY_INCOMING_RUNNING)) {
+        return;
+    }
+
+    mis->have_preempt_thread = true;
+    qemu_thread_create(&mis->postcopy_preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    if (mis->postcopy_qemufile_dst) {
+        error_report("%s: postcopy preempt channel already connected",
+                     __func__);
+        qemu_fclose(f);
+        return;
+    }
+
+    /* The preempt thread reads it outside of any coroutine */
+    qemu_file_set_blocking(f, true);
+    mis->postcopy_qemufile_dst = f;
+    trace_postcopy_preempt_new_channel();
+
+    postcopy_preempt_thread_start(mis);
+}
+
 /**
  * postcopy_discard_send_init: Called at the start of each RAMBlock before
  *   asking to discard individual ranges.
@@ -106,6 +106,14 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/*
+ * Postcopy preempt channel: the source connects it at the start of the
+ * migration and sends the pages requested by the destination on it.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+void postcopy_preempt_thread_start(MigrationIncomingState *mis);
+
 /*
  * To be called once at the start before any device initialisation
  */
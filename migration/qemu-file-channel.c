@@ -27,6 +27,7 @@
 #include "qemu-file.h"
 #include "io/channel-socket.h"
 #include "qemu/iov.h"
+#include "qapi/error.h"
 
 
 static ssize_t channel_writev_buffer(void *opaque,
@@ -146,6 +147,75 @@ static int channel_set_blocking(void *opaque,
     return 0;
 }
 
+static int64_t channel_seek(void *opaque,
+                            int64_t offset,
+                            int whence,
+                            Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    off_t ret;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_setg(errp, "Channel does not support random access");
+        return -ENOTSUP;
+    }
+
+    ret = qio_channel_io_seek(ioc, offset, whence, errp);
+    if (ret < 0) {
+        return -EIO;
+    }
+    return ret;
+}
+
+
+static ssize_t channel_put_buffer_at(void *opaque,
+                                     uint8_t *buf,
+                                     size_t size,
+                                     int64_t pos,
+                                     Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t len = qio_channel_pwrite(ioc, (char *)buf + done, size - done,
+                                         pos + done, errp);
+        if (len < 0) {
+            return -EIO;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+
+static ssize_t channel_get_buffer_at(void *opaque,
+                                     uint8_t *buf,
+                                     size_t size,
+                                     int64_t pos,
+                                     Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t len = qio_channel_pread(ioc, (char *)buf + done, size - done,
+                                        pos + done, errp);
+        if (len < 0) {
+            return -EIO;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unexpected end of file at offset %" PRId64,
+                       pos + done);
+            return -EIO;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
 static QEMUFile *channel_get_input_return_path(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -166,6 +236,9 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .seek = channel_seek,
+    .put_buffer_at = channel_put_buffer_at,
+    .get_buffer_at = channel_get_buffer_at,
 };
 
 
@@ -175,6 +248,9 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .seek = channel_seek,
+    .put_buffer_at = channel_put_buffer_at,
+    .get_buffer_at = channel_get_buffer_at,
 };
 
 
@@ -42,7 +42,8 @@ struct QEMUFile {
     int64_t xfer_limit;
 
     int64_t pos; /* start of buffer when writing, end of buffer
-                    when reading */
+                    when reading; files that seek only count the
+                    bytes transferred here */
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
@@ -836,3 +837,102 @@ void qemu_file_set_blocking(QEMUFile *f, bool block)
         f->ops->set_blocking(f->opaque, block, NULL);
     }
 }
+
+/*
+ * Returns true if the file supports qemu_set_offset() and the positioned
+ * I/O functions
+ */
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->seek && f->ops->put_buffer_at && f->ops->get_buffer_at &&
+           f->ops->seek(f->opaque, 0, SEEK_CUR, NULL) >= 0;
+}
+
+/*
+ * Returns the position of the stream in the underlying file, or a
+ * negative errno value
+ */
+int64_t qemu_get_offset(QEMUFile *f)
+{
+    Error *local_error = NULL;
+    int64_t ret;
+
+    qemu_fflush(f);
+
+    ret = f->ops->seek(f->opaque, 0, SEEK_CUR, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+
+    if (!qemu_file_is_writable(f)) {
+        /* The buffer holds what was read ahead of the stream position */
+        ret -= f->buf_size - f->buf_index;
+    }
+    return ret;
+}
+
+/*
+ * Moves the stream to @offset in the underlying file; pending data is
+ * written out first, data that was read ahead is dropped.
+ *
+ * Returns 0 on success or a negative errno value
+ */
+int qemu_set_offset(QEMUFile *f, int64_t offset)
+{
+    Error *local_error = NULL;
+    int64_t ret;
+
+    qemu_fflush(f);
+
+    if (!qemu_file_is_writable(f)) {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = f->ops->seek(f->opaque, offset, SEEK_SET, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Writes @buf at @pos in the underlying file, bypassing the stream.
+ * Errors are reported through the file error state.
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos)
+{
+    Error *local_error = NULL;
+    ssize_t ret;
+
+    if (f->last_error) {
+        return;
+    }
+
+    ret = f->ops->put_buffer_at(f->opaque, (uint8_t *)buf, size, pos,
+                                &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return;
+    }
+
+    f->bytes_xfer += size;
+    f->pos += size;
+}
+
+/*
+ * Reads @size bytes at @pos in the underlying file into @buf.
+ *
+ * Returns 0 on success or a negative errno value
+ */
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size, int64_t pos,
+                       Error **errp)
+{
+    ssize_t ret;
+
+    ret = f->ops->get_buffer_at(f->opaque, buf, size, pos, errp);
+    return ret < 0 ? ret : 0;
+}
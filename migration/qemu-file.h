@@ -103,6 +103,23 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr,
                                    Error **errp);
 
+/*
+ * Move the position of the underlying file, as lseek() does.
+ * Returns the new position, or a negative errno value.
+ */
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset, int whence,
+                                   Error **errp);
+
+/*
+ * Read or write the buffer at an absolute position in the underlying
+ * file, without moving the stream position.  The handler must transfer
+ * all of the data or return a negative errno value.  Only available on
+ * files that can seek.
+ */
+typedef ssize_t (QEMUFileBufferAtFunc)(void *opaque, uint8_t *buf,
+                                       size_t size, int64_t pos,
+                                       Error **errp);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -110,6 +127,9 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileSeekFunc *seek;
+    QEMUFileBufferAtFunc *put_buffer_at;
+    QEMUFileBufferAtFunc *get_buffer_at;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -162,6 +182,19 @@ QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 void qemu_file_set_blocking(QEMUFile *f, bool block);
 
+/*
+ * Random access to files that can seek, such as regular files.
+ * Offsets are absolute positions in the underlying file.
+ */
+bool qemu_file_is_seekable(QEMUFile *f);
+int64_t qemu_get_offset(QEMUFile *f);
+int qemu_set_offset(QEMUFile *f, int64_t offset);
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos);
+/* Doesn't touch the stream state, so several threads may call it */
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size, int64_t pos,
+                       Error **errp);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags, void *data);
@@ -56,6 +56,10 @@
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "qemu/userfaultfd.h"
+#include "sysemu/balloon.h"
+#include "multifd.h"
+#include "timings.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -309,6 +313,10 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Last block sent on the postcopy preempt channel */
+    RAMBlock *postcopy_last_sent_block;
+    /* Set while urgent pages are sent on the postcopy preempt channel */
+    bool postcopy_preempting;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -350,6 +358,19 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+
+    /* Background snapshot: userfaultfd tracking writes to guest RAM */
+    int uffdio_fd;
+    /* Saved pages whose write protection is still to be removed */
+    void *wp_release_host;
+    uint64_t wp_release_len;
+    /* Ballooning is inhibited while RAM is write tracked */
+    bool wp_balloon_inhibited;
+
+    /* Mapped-ram: run of pages still to be written to the file */
+    RAMBlock *mapped_ram_block;
+    ram_addr_t mapped_ram_offset;
+    size_t mapped_ram_len;
 };
 typedef struct RAMState RAMState;
 
@@ -511,1042 +532,68 @@ static void compress_threads_save_cleanup(void)
             break;
         }
 
-        qemu_mutex_lock(&comp_param[i].mutex);
-        comp_param[i].quit = true;
-        qemu_cond_signal(&comp_param[i].cond);
-        qemu_mutex_unlock(&comp_param[i].mutex);
-
-        qemu_thread_join(compress_threads + i);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
-        deflateEnd(&comp_param[i].stream);
-        g_free(comp_param[i].originbuf);
-        qemu_fclose(comp_param[i].file);
-        comp_param[i].file = NULL;
-    }
-    qemu_mutex_destroy(&comp_done_lock);
-    qemu_cond_destroy(&comp_done_cond);
-    g_free(compress_threads);
-    g_free(comp_param);
-    compress_threads = NULL;
-    comp_param = NULL;
-}
-
-static int compress_threads_save_setup(void)
-{
-    int i, thread_count;
-
-    if (!migrate_use_compression()) {
-        return 0;
-    }
-    thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
-    comp_param = g_new0(CompressParam, thread_count);
-    qemu_cond_init(&comp_done_cond);
-    qemu_mutex_init(&comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        comp_param[i].originbuf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!comp_param[i].originbuf) {
-            goto exit;
-        }
-
-        if (deflateInit(&comp_param[i].stream,
-                        migrate_compress_level()) != Z_OK) {
-            g_free(comp_param[i].originbuf);
-            goto exit;
-        }
-
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        comp_param[i].quit = false;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
-        qemu_thread_create(compress_threads + i, "compress",
-                           do_data_compress, comp_param + i,
-                           QEMU_THREAD_JOINABLE);
-    }
-    return 0;
-
-exit:
-    compress_threads_save_cleanup();
-    return -1;
-}
-
-/* Multiple fd's */
-
-#define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
-
-#define MULTIFD_FLAG_SYNC (1 << 0)
-
-/* This value needs to be a multiple of qemu_target_page_size() */
-#define MULTIFD_PACKET_SIZE (512 * 1024)
-
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    unsigned char uuid[16]; /* QemuUUID */
-    uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
-    uint64_t unused2[4];    /* Reserved for future use */
-} __attribute__((packed)) MultiFDInit_t;
-
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t flags;
-    /* maximum number of allocated pages */
-    uint32_t pages_alloc;
-    uint32_t pages_used;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
-    char ramblock[256];
-    uint64_t offset[];
-} __attribute__((packed)) MultiFDPacket_t;
-
-typedef struct {
-    /* number of used pages */
-    uint32_t used;
-    /* number of allocated pages */
-    uint32_t allocated;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* offset of each page */
-    ram_addr_t *offset;
-    /* pointer to each page */
-    struct iovec *iov;
-    RAMBlock *block;
-} MultiFDPages_t;
-
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* sem where to wait for more work */
-    QemuSemaphore sem;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* thread has work to do */
-    int pending_job;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-}  MultiFDSendParams;
-
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* array of pages to receive */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-} MultiFDRecvParams;
-
-static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
-{
-    MultiFDInit_t msg = {};
-    int ret;
-
-    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
-    msg.version = cpu_to_be32(MULTIFD_VERSION);
-    msg.id = p->id;
-    memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
-
-    ret = qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
-    if (ret != 0) {
-        return -1;
-    }
-    return 0;
-}
-
-static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
-{
-    MultiFDInit_t msg;
-    int ret;
-
-    ret = qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp);
-    if (ret != 0) {
-        return -1;
-    }
-
-    msg.magic = be32_to_cpu(msg.magic);
-    msg.version = be32_to_cpu(msg.version);
-
-    if (msg.magic != MULTIFD_MAGIC) {
-        error_setg(errp, "multifd: received packet magic %x "
-                   "expected %x", msg.magic, MULTIFD_MAGIC);
-        return -1;
-    }
-
-    if (msg.version != MULTIFD_VERSION) {
-        error_setg(errp, "multifd: received packet version %d "
-                   "expected %d", msg.version, MULTIFD_VERSION);
-        return -1;
-    }
-
-    if (memcmp(msg.uuid, &qemu_uuid, sizeof(qemu_uuid))) {
-        char *uuid = qemu_uuid_unparse_strdup(&qemu_uuid);
-        char *msg_uuid = qemu_uuid_unparse_strdup((const QemuUUID *)msg.uuid);
-
-        error_setg(errp, "multifd: received uuid '%s' and expected "
-                   "uuid '%s' for channel %hhd", msg_uuid, uuid, msg.id);
-        g_free(uuid);
-        g_free(msg_uuid);
-        return -1;
-    }
-
-    if (msg.id > migrate_multifd_channels()) {
-        error_setg(errp, "multifd: received channel version %d "
-                   "expected %d", msg.version, MULTIFD_VERSION);
-        return -1;
-    }
-
-    return msg.id;
-}
-
-static MultiFDPages_t *multifd_pages_init(size_t size)
-{
-    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
-
-    pages->allocated = size;
-    pages->iov = g_new0(struct iovec, size);
-    pages->offset = g_new0(ram_addr_t, size);
-
-    return pages;
-}
-
-static void multifd_pages_clear(MultiFDPages_t *pages)
-{
-    pages->used = 0;
-    pages->allocated = 0;
-    pages->packet_num = 0;
-    pages->block = NULL;
-    g_free(pages->iov);
-    pages->iov = NULL;
-    g_free(pages->offset);
-    pages->offset = NULL;
-    g_free(pages);
-}
-
-static void multifd_send_fill_packet(MultiFDSendParams *p)
-{
-    MultiFDPacket_t *packet = p->packet;
-    int i;
-
-    packet->flags = cpu_to_be32(p->flags);
-    packet->pages_alloc = cpu_to_be32(p->pages->allocated);
-    packet->pages_used = cpu_to_be32(p->pages->used);
-    packet->next_packet_size = cpu_to_be32(p->next_packet_size);
-    packet->packet_num = cpu_to_be64(p->packet_num);
-
-    if (p->pages->block) {
-        strncpy(packet->ramblock, p->pages->block->idstr, 256);
-    }
-
-    for (i = 0; i < p->pages->used; i++) {
-        /* there are architectures where ram_addr_t is 32 bit */
-        uint64_t temp = p->pages->offset[i];
-
-        packet->offset[i] = cpu_to_be64(temp);
-    }
-}
-
-static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
-{
-    MultiFDPacket_t *packet = p->packet;
-    uint32_t pages_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
-    RAMBlock *block;
-    int i;
-
-    packet->magic = be32_to_cpu(packet->magic);
-    if (packet->magic != MULTIFD_MAGIC) {
-        error_setg(errp, "multifd: received packet "
-                   "magic %x and expected magic %x",
-                   packet->magic, MULTIFD_MAGIC);
-        return -1;
-    }
-
-    packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
-        error_setg(errp, "multifd: received packet "
-                   "version %d and expected version %d",
-                   packet->version, MULTIFD_VERSION);
-        return -1;
-    }
-
-    p->flags = be32_to_cpu(packet->flags);
-
-    packet->pages_alloc = be32_to_cpu(packet->pages_alloc);
-    /*
-     * If we received a packet that is 100 times bigger than expected
-     * just stop migration.  It is a magic number.
-     */
-    if (packet->pages_alloc > pages_max * 100) {
-        error_setg(errp, "multifd: received packet "
-                   "with size %d and expected a maximum size of %d",
-                   packet->pages_alloc, pages_max * 100) ;
-        return -1;
-    }
-    /*
-     * We received a packet that is bigger than expected but inside
-     * reasonable limits (see previous comment).  Just reallocate.
-     */
-    if (packet->pages_alloc > p->pages->allocated) {
-        multifd_pages_clear(p->pages);
-        p->pages = multifd_pages_init(packet->pages_alloc);
-    }
-
-    p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
-        error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
-        return -1;
-    }
-
-    p->next_packet_size = be32_to_cpu(packet->next_packet_size);
-    p->packet_num = be64_to_cpu(packet->packet_num);
-
-    if (p->pages->used == 0) {
-        return 0;
-    }
-
-    /* make sure that ramblock is 0 terminated */
-    packet->ramblock[255] = 0;
-    block = qemu_ram_block_by_name(packet->ramblock);
-    if (!block) {
-        error_setg(errp, "multifd: unknown ram block %s",
-                   packet->ramblock);
-        return -1;
-    }
-
-    for (i = 0; i < p->pages->used; i++) {
-        uint64_t offset = be64_to_cpu(packet->offset[i]);
-
-        if (offset > (block->used_length - TARGET_PAGE_SIZE)) {
-            error_setg(errp, "multifd: offset too long %" PRIu64
-                       " (max " RAM_ADDR_FMT ")",
-                       offset, block->max_length);
-            return -1;
-        }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
-    }
-
-    return 0;
-}
-
-struct {
-    MultiFDSendParams *params;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* send channels ready */
-    QemuSemaphore channels_ready;
-    /*
-     * Have we already run terminate threads.  There is a race when it
-     * happens that we got one error while we are exiting.
-     * We will use atomic operations.  Only valid values are 0 and 1.
-     */
-    int exiting;
-} *multifd_send_state;
-
-/*
- * How we use multifd_send_state->pages and channel->pages?
- *
- * We create a pages for each channel, and a main one.  Each time that
- * we need to send a batch of pages we interchange the ones between
- * multifd_send_state and the channel that is sending it.  There are
- * two reasons for that:
- *    - to not have to do so many mallocs during migration
- *    - to make easier to know what to free at the end of migration
- *
- * This way we always know who is the owner of each "pages" struct,
- * and we don't need any locking.  It belongs to the migration thread
- * or to the channel thread.  Switching is safe because the migration
- * thread is using the channel mutex when changing it, and the channel
- * have to had finish with its own, otherwise pending_job can't be
- * false.
- */
-
-static int multifd_send_pages(RAMState *rs)
-{
-    int i;
-    static int next_channel;
-    MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
-
-    if (atomic_read(&multifd_send_state->exiting)) {
-        return -1;
-    }
-
-    qemu_sem_wait(&multifd_send_state->channels_ready);
-    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
-        p = &multifd_send_state->params[i];
-
-        qemu_mutex_lock(&p->mutex);
-        if (p->quit) {
-            error_report("%s: channel %d has already quit!", __func__, i);
-            qemu_mutex_unlock(&p->mutex);
-            return -1;
-        }
-        if (!p->pending_job) {
-            p->pending_job++;
-            next_channel = (i + 1) % migrate_multifd_channels();
-            break;
-        }
-        qemu_mutex_unlock(&p->mutex);
-    }
-    assert(!p->pages->used);
-    assert(!p->pages->block);
-
-    p->packet_num = multifd_send_state->packet_num++;
-    multifd_send_state->pages = p->pages;
-    p->pages = pages;
-    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
-    qemu_file_update_transfer(rs->f, transferred);
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
-    qemu_mutex_unlock(&p->mutex);
-    qemu_sem_post(&p->sem);
-
-    return 1;
-}
-
-static int multifd_queue_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
-{
-    MultiFDPages_t *pages = multifd_send_state->pages;
-
-    if (!pages->block) {
-        pages->block = block;
-    }
-
-    if (pages->block == block) {
-        pages->offset[pages->used] = offset;
-        pages->iov[pages->used].iov_base = block->host + offset;
-        pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
-        pages->used++;
-
-        if (pages->used < pages->allocated) {
-            return 1;
-        }
-    }
-
-    if (multifd_send_pages(rs) < 0) {
-        return -1;
-    }
-
-    if (pages->block != block) {
-        return  multifd_queue_page(rs, block, offset);
-    }
-
-    return 1;
-}
-
-static void multifd_send_terminate_threads(Error *err)
-{
-    int i;
-
-    trace_multifd_send_terminate_threads(err != NULL);
-
-    if (err) {
-        MigrationState *s = migrate_get_current();
-        migrate_set_error(s, err);
-        if (s->state == MIGRATION_STATUS_SETUP ||
-            s->state == MIGRATION_STATUS_PRE_SWITCHOVER ||
-            s->state == MIGRATION_STATUS_DEVICE ||
-            s->state == MIGRATION_STATUS_ACTIVE) {
-            migrate_set_state(&s->state, s->state,
-                              MIGRATION_STATUS_FAILED);
-        }
-    }
-
-    /*
-     * We don't want to exit each threads twice.  Depending on where
-     * we get the error, or if there are two independent errors in two
-     * threads at the same time, we can end calling this function
-     * twice.
-     */
-    if (atomic_xchg(&multifd_send_state->exiting, 1)) {
-        return;
-    }
-
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDSendParams *p = &multifd_send_state->params[i];
-
-        qemu_mutex_lock(&p->mutex);
-        p->quit = true;
-        qemu_sem_post(&p->sem);
-        qemu_mutex_unlock(&p->mutex);
-    }
-}
-
-void multifd_save_cleanup(void)
-{
-    int i;
-
-    if (!migrate_use_multifd()) {
-        return;
-    }
-    multifd_send_terminate_threads(NULL);
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDSendParams *p = &multifd_send_state->params[i];
-
-        if (p->running) {
-            qemu_thread_join(&p->thread);
-        }
-    }
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDSendParams *p = &multifd_send_state->params[i];
-
-        socket_send_channel_destroy(p->c);
-        p->c = NULL;
-        qemu_mutex_destroy(&p->mutex);
-        qemu_sem_destroy(&p->sem);
-        qemu_sem_destroy(&p->sem_sync);
-        g_free(p->name);
-        p->name = NULL;
-        multifd_pages_clear(p->pages);
-        p->pages = NULL;
-        p->packet_len = 0;
-        g_free(p->packet);
-        p->packet = NULL;
-    }
-    qemu_sem_destroy(&multifd_send_state->channels_ready);
-    g_free(multifd_send_state->params);
-    multifd_send_state->params = NULL;
-    multifd_pages_clear(multifd_send_state->pages);
-    multifd_send_state->pages = NULL;
-    g_free(multifd_send_state);
-    multifd_send_state = NULL;
-}
-
-static void multifd_send_sync_main(RAMState *rs)
-{
-    int i;
-
-    if (!migrate_use_multifd()) {
-        return;
-    }
-    if (multifd_send_state->pages->used) {
-        if (multifd_send_pages(rs) < 0) {
-            error_report("%s: multifd_send_pages fail", __func__);
-            return;
-        }
-    }
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDSendParams *p = &multifd_send_state->params[i];
-
-        trace_multifd_send_sync_main_signal(p->id);
-
-        qemu_mutex_lock(&p->mutex);
-
-        if (p->quit) {
-            error_report("%s: channel %d has already quit", __func__, i);
-            qemu_mutex_unlock(&p->mutex);
-            return;
-        }
-
-        p->packet_num = multifd_send_state->packet_num++;
-        p->flags |= MULTIFD_FLAG_SYNC;
-        p->pending_job++;
-        qemu_file_update_transfer(rs->f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
-        qemu_mutex_unlock(&p->mutex);
-        qemu_sem_post(&p->sem);
-    }
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDSendParams *p = &multifd_send_state->params[i];
-
-        trace_multifd_send_sync_main_wait(p->id);
-        qemu_sem_wait(&p->sem_sync);
-    }
-    trace_multifd_send_sync_main(multifd_send_state->packet_num);
-}
-
-static void *multifd_send_thread(void *opaque)
-{
-    MultiFDSendParams *p = opaque;
-    Error *local_err = NULL;
-    int ret = 0;
-    uint32_t flags = 0;
-
-    trace_multifd_send_thread_start(p->id);
-    rcu_register_thread();
-
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
-    }
-    /* initial packet */
-    p->num_packets = 1;
-
-    while (true) {
-        qemu_sem_wait(&p->sem);
-
-        if (atomic_read(&multifd_send_state->exiting)) {
-            break;
-        }
-        qemu_mutex_lock(&p->mutex);
-
-        if (p->pending_job) {
-            uint32_t used = p->pages->used;
-            uint64_t packet_num = p->packet_num;
-            flags = p->flags;
-
-            p->next_packet_size = used * qemu_target_page_size();
-            multifd_send_fill_packet(p);
-            p->flags = 0;
-            p->num_packets++;
-            p->num_pages += used;
-            p->pages->used = 0;
-            p->pages->block = NULL;
-            qemu_mutex_unlock(&p->mutex);
-
-            trace_multifd_send(p->id, packet_num, used, flags,
-                               p->next_packet_size);
-
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
-            if (ret != 0) {
-                break;
-            }
-
-            if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
-                if (ret != 0) {
-                    break;
-                }
-            }
-
-            qemu_mutex_lock(&p->mutex);
-            p->pending_job--;
-            qemu_mutex_unlock(&p->mutex);
-
-            if (flags & MULTIFD_FLAG_SYNC) {
-                qemu_sem_post(&p->sem_sync);
-            }
-            qemu_sem_post(&multifd_send_state->channels_ready);
-        } else if (p->quit) {
-            qemu_mutex_unlock(&p->mutex);
-            break;
-        } else {
-            qemu_mutex_unlock(&p->mutex);
-            /* sometimes there are spurious wakeups */
-        }
-    }
-
-out:
-    if (local_err) {
-        trace_multifd_send_error(p->id);
-        multifd_send_terminate_threads(local_err);
-    }
-
-    /*
-     * Error happen, I will exit, but I can't just leave, tell
-     * who pay attention to me.
-     */
-    if (ret != 0) {
-        qemu_sem_post(&p->sem_sync);
-        qemu_sem_post(&multifd_send_state->channels_ready);
-    }
-
-    qemu_mutex_lock(&p->mutex);
-    p->running = false;
-    qemu_mutex_unlock(&p->mutex);
-
-    rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
-
-    return NULL;
-}
-
-static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
-{
-    MultiFDSendParams *p = opaque;
-    QIOChannel *sioc = QIO_CHANNEL(qio_task_get_source(task));
-    Error *local_err = NULL;
-
-    trace_multifd_new_send_channel_async(p->id);
-    if (qio_task_propagate_error(task, &local_err)) {
-        migrate_set_error(migrate_get_current(), local_err);
-        multifd_save_cleanup();
-    } else {
-        p->c = QIO_CHANNEL(sioc);
-        qio_channel_set_delay(p->c, false);
-        p->running = true;
-        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
-                           QEMU_THREAD_JOINABLE);
-    }
-}
-
-int multifd_save_setup(void)
-{
-    int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
-    uint8_t i;
-
-    if (!migrate_use_multifd()) {
-        return 0;
-    }
-    thread_count = migrate_multifd_channels();
-    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
-    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
-    multifd_send_state->pages = multifd_pages_init(page_count);
-    qemu_sem_init(&multifd_send_state->channels_ready, 0);
-    atomic_set(&multifd_send_state->exiting, 0);
-
-    for (i = 0; i < thread_count; i++) {
-        MultiFDSendParams *p = &multifd_send_state->params[i];
-
-        qemu_mutex_init(&p->mutex);
-        qemu_sem_init(&p->sem, 0);
-        qemu_sem_init(&p->sem_sync, 0);
-        p->quit = false;
-        p->pending_job = 0;
-        p->id = i;
-        p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
-        p->packet = g_malloc0(p->packet_len);
-        p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-        p->packet->version = cpu_to_be32(MULTIFD_VERSION);
-        p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
-    }
-    return 0;
-}
-
-struct {
-    MultiFDRecvParams *params;
-    /* number of created threads */
-    int count;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-} *multifd_recv_state;
-
-static void multifd_recv_terminate_threads(Error *err)
-{
-    int i;
-
-    trace_multifd_recv_terminate_threads(err != NULL);
-
-    if (err) {
-        MigrationState *s = migrate_get_current();
-        migrate_set_error(s, err);
-        if (s->state == MIGRATION_STATUS_SETUP ||
-            s->state == MIGRATION_STATUS_ACTIVE) {
-            migrate_set_state(&s->state, s->state,
-                              MIGRATION_STATUS_FAILED);
-        }
-    }
-
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDRecvParams *p = &multifd_recv_state->params[i];
-
-        qemu_mutex_lock(&p->mutex);
-        p->quit = true;
-        /* We could arrive here for two reasons:
-           - normal quit, i.e. everything went fine, just finished
-           - error quit: We close the channels so the channel threads
-             finish the qio_channel_read_all_eof() */
-        if (p->c) {
-            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
-        }
-        qemu_mutex_unlock(&p->mutex);
-    }
-}
-
-int multifd_load_cleanup(Error **errp)
-{
-    int i;
-    int ret = 0;
-
-    if (!migrate_use_multifd()) {
-        return 0;
-    }
-    multifd_recv_terminate_threads(NULL);
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDRecvParams *p = &multifd_recv_state->params[i];
-
-        if (p->running) {
-            p->quit = true;
-            /*
-             * multifd_recv_thread may hung at MULTIFD_FLAG_SYNC handle code,
-             * however try to wakeup it without harm in cleanup phase.
-             */
-            qemu_sem_post(&p->sem_sync);
-            qemu_thread_join(&p->thread);
-        }
-    }
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDRecvParams *p = &multifd_recv_state->params[i];
-
-        object_unref(OBJECT(p->c));
-        p->c = NULL;
-        qemu_mutex_destroy(&p->mutex);
-        qemu_sem_destroy(&p->sem_sync);
-        g_free(p->name);
-        p->name = NULL;
-        multifd_pages_clear(p->pages);
-        p->pages = NULL;
-        p->packet_len = 0;
-        g_free(p->packet);
-        p->packet = NULL;
-    }
-    qemu_sem_destroy(&multifd_recv_state->sem_sync);
-    g_free(multifd_recv_state->params);
-    multifd_recv_state->params = NULL;
-    g_free(multifd_recv_state);
-    multifd_recv_state = NULL;
-
-    return ret;
-}
-
-static void multifd_recv_sync_main(void)
-{
-    int i;
-
-    if (!migrate_use_multifd()) {
-        return;
-    }
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDRecvParams *p = &multifd_recv_state->params[i];
-
-        trace_multifd_recv_sync_main_wait(p->id);
-        qemu_sem_wait(&multifd_recv_state->sem_sync);
-    }
-    for (i = 0; i < migrate_multifd_channels(); i++) {
-        MultiFDRecvParams *p = &multifd_recv_state->params[i];
-
-        qemu_mutex_lock(&p->mutex);
-        if (multifd_recv_state->packet_num < p->packet_num) {
-            multifd_recv_state->packet_num = p->packet_num;
-        }
-        qemu_mutex_unlock(&p->mutex);
-        trace_multifd_recv_sync_main_signal(p->id);
-        qemu_sem_post(&p->sem_sync);
-    }
-    trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
-}
-
-static void *multifd_recv_thread(void *opaque)
-{
-    MultiFDRecvParams *p = opaque;
-    Error *local_err = NULL;
-    int ret;
-
-    trace_multifd_recv_thread_start(p->id);
-    rcu_register_thread();
-
-    while (true) {
-        uint32_t used;
-        uint32_t flags;
-
-        if (p->quit) {
-            break;
-        }
-
-        ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
-                                       p->packet_len, &local_err);
-        if (ret == 0) {   /* EOF */
-            break;
-        }
-        if (ret == -1) {   /* Error */
-            break;
-        }
-
-        qemu_mutex_lock(&p->mutex);
-        ret = multifd_recv_unfill_packet(p, &local_err);
-        if (ret) {
-            qemu_mutex_unlock(&p->mutex);
-            break;
-        }
-
-        used = p->pages->used;
-        flags = p->flags;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
-                           p->next_packet_size);
-        p->num_packets++;
-        p->num_pages += used;
-        qemu_mutex_unlock(&p->mutex);
-
-        if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
-            if (ret != 0) {
-                break;
-            }
-        }
-
-        if (flags & MULTIFD_FLAG_SYNC) {
-            qemu_sem_post(&multifd_recv_state->sem_sync);
-            qemu_sem_wait(&p->sem_sync);
-        }
-    }
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
 
-    if (local_err) {
-        multifd_recv_terminate_threads(local_err);
+        qemu_thread_join(compress_threads + i);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+        deflateEnd(&comp_param[i].stream);
+        g_free(comp_param[i].originbuf);
+        qemu_fclose(comp_param[i].file);
+        comp_param[i].file = NULL;
     }
-    qemu_mutex_lock(&p->mutex);
-    p->running = false;
-    qemu_mutex_unlock(&p->mutex);
-
-    rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
-
-    return NULL;
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(compress_threads);
+    g_free(comp_param);
+    compress_threads = NULL;
+    comp_param = NULL;
 }
 
-int multifd_load_setup(void)
+static int compress_threads_save_setup(void)
 {
-    int thread_count;
-    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
-    uint8_t i;
+    int i, thread_count;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_compression()) {
         return 0;
     }
-    thread_count = migrate_multifd_channels();
-    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
-    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
-    atomic_set(&multifd_recv_state->count, 0);
-    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
-
+    thread_count = migrate_compress_threads();
+    compress_threads = g_new0(QemuThread, thread_count);
+    comp_param = g_new0(CompressParam, thread_count);
+    qemu_cond_init(&comp_done_cond);
+    qemu_mutex_init(&comp_done_lock);
     for (i = 0; i < thread_count; i++) {
-        MultiFDRecvParams *p = &multifd_recv_state->params[i];
-
-        qemu_mutex_init(&p->mutex);
-        qemu_sem_init(&p->sem_sync, 0);
-        p->quit = false;
-        p->id = i;
-        p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
-        p->packet = g_malloc0(p->packet_len);
-        p->name = g_strdup_printf("multifdrecv_%d", i);
-    }
-    return 0;
-}
-
-bool multifd_recv_all_channels_created(void)
-{
-    int thread_count = migrate_multifd_channels();
-
-    if (!migrate_use_multifd()) {
-        return true;
-    }
-
-    return thread_count == atomic_read(&multifd_recv_state->count);
-}
+        comp_param[i].originbuf = g_try_malloc(TARGET_PAGE_SIZE);
+        if (!comp_param[i].originbuf) {
+            goto exit;
+        }
 
-/*
- * Try to receive all multifd channels to get ready for the migration.
- * - Return true and do not set @errp when correctly receving all channels;
- * - Return false and do not set @errp when correctly receiving the current one;
- * - Return false and set @errp when failing to receive the current channel.
- */
-bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
-{
-    MultiFDRecvParams *p;
-    Error *local_err = NULL;
-    int id;
-
-    id = multifd_recv_initial_packet(ioc, &local_err);
-    if (id < 0) {
-        multifd_recv_terminate_threads(local_err);
-        error_propagate_prepend(errp, local_err,
-                                "failed to receive packet"
-                                " via multifd channel %d: ",
-                                atomic_read(&multifd_recv_state->count));
-        return false;
-    }
-    trace_multifd_recv_new_channel(id);
+        if (deflateInit(&comp_param[i].stream,
+                        migrate_compress_level()) != Z_OK) {
+            g_free(comp_param[i].originbuf);
+            goto exit;
+        }
 
-    p = &multifd_recv_state->params[id];
-    if (p->c != NULL) {
-        error_setg(&local_err, "multifd: received id '%d' already setup'",
-                   id);
-        multifd_recv_terminate_threads(local_err);
-        error_propagate(errp, local_err);
-        return false;
+        /* comp_param[i].file is just used as a dummy buffer to save data,
+         * set its ops to empty.
+         */
+        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].done = true;
+        comp_param[i].quit = false;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(compress_threads + i, "compress",
+                           do_data_compress, comp_param + i,
+                           QEMU_THREAD_JOINABLE);
     }
-    p->c = ioc;
-    object_ref(OBJECT(ioc));
-    /* initial packet */
-    p->num_packets = 1;
+    return 0;
 
-    p->running = true;
-    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
-                       QEMU_THREAD_JOINABLE);
-    atomic_inc(&multifd_recv_state->count);
-    return atomic_read(&multifd_recv_state->count) ==
-           migrate_multifd_channels();
+exit:
+    compress_threads_save_cleanup();
+    return -1;
 }
 
 /**
@@ -1628,8 +675,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) > 0) {
+        xbzrle_counters.cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -1652,17 +701,21 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret < 0) {
                 return -1;
             } else {
+                if (ret > 0) {
+                    xbzrle_counters.cache_evictions++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -1670,6 +723,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         }
         return -1;
     }
+    xbzrle_counters.cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -2128,10 +1182,10 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
-    if (multifd_queue_page(rs, block, offset) < 0) {
+    /* The channel that sends the page accounts for it in ram_counters */
+    if (multifd_queue_page(rs->f, block, offset) < 0) {
         return -1;
     }
-    ram_counters.normal++;
 
     return 1;
 }
@@ -2317,6 +1371,331 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
     }
 }
 
+/*
+ * Saved pages are unprotected in runs of up to this many bytes rather
+ * than with one ioctl each; a write fault flushes the pending run.
+ */
+#define WP_RELEASE_MAX_LEN (1 << 20)
+
+#ifdef CONFIG_LINUX
+static bool ram_block_is_write_tracked(RAMBlock *block)
+{
+    /* Read-only and MMIO-writable regions are not written by the guest */
+    return !block->mr->readonly && !block->mr->rom_device;
+}
+
+/**
+ * ram_write_tracking_release: remove the write protection from the run
+ * of saved pages that is still pending
+ *
+ * Returns 0 for success or -1 in case of error
+ *
+ * @rs: current RAM state
+ */
+static int ram_write_tracking_release(RAMState *rs)
+{
+    int ret;
+
+    if (!rs->wp_release_len) {
+        return 0;
+    }
+
+    ret = uffd_change_protection(rs->uffdio_fd, rs->wp_release_host,
+                                 rs->wp_release_len, false, false);
+    rs->wp_release_len = 0;
+    return ret;
+}
+
+/**
+ * ram_save_release_protection: unprotect the pages that were just saved
+ *
+ * The pages are only added to the pending run, which is released when it
+ * can't be extended any further.  They have been copied into the
+ * QEMUFile already, so the guest is free to modify them.
+ *
+ * Returns 0 for success or -1 in case of error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we have sent
+ * @start_page: first page of the host page that was sent
+ */
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    uint8_t *host;
+    uint64_t len;
+    int ret;
+
+    if (!(pss->block->flags & RAM_UF_WRITEPROTECT)) {
+        return 0;
+    }
+
+    host = pss->block->host + ((ram_addr_t)start_page << TARGET_PAGE_BITS);
+    len = (uint64_t)(pss->page - start_page + 1) << TARGET_PAGE_BITS;
+
+    if (rs->wp_release_len &&
+        (uint8_t *)rs->wp_release_host + rs->wp_release_len == host &&
+        rs->wp_release_len + len <= WP_RELEASE_MAX_LEN) {
+        rs->wp_release_len += len;
+        return 0;
+    }
+
+    ret = ram_write_tracking_release(rs);
+    rs->wp_release_host = host;
+    rs->wp_release_len = len;
+    return ret;
+}
+
+/**
+ * poll_fault_page: get the page that a guest write is blocked on
+ *
+ * Returns the block of the page, or NULL if no write is blocked
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    struct uffd_msg uffd_msg;
+    void *page_address;
+    RAMBlock *block;
+
+    if (rs->uffdio_fd < 0 ||
+        uffd_read_events(rs->uffdio_fd, &uffd_msg, 1) <= 0 ||
+        uffd_msg.event != UFFD_EVENT_PAGEFAULT) {
+        return NULL;
+    }
+
+    /* The page may be in the pending run, saved already */
+    ram_write_tracking_release(rs);
+
+    page_address = (void *)(uintptr_t)uffd_msg.arg.pagefault.address;
+    block = qemu_ram_block_from_host(page_address, false, offset);
+    assert(block && (block->flags & RAM_UF_WRITEPROTECT));
+    trace_poll_fault_page(block->idstr, *offset);
+    return block;
+}
+
+/**
+ * ram_write_tracking_available: check if the kernel can write protect
+ * memory with userfaultfd
+ */
+bool ram_write_tracking_available(void)
+{
+    uint64_t uffd_features;
+
+    if (uffd_query_features(&uffd_features)) {
+        return false;
+    }
+    return !!(uffd_features & UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+}
+
+/**
+ * ram_write_tracking_compatible: check if all of guest RAM can be write
+ * protected with userfaultfd (e.g. shared or hugetlbfs memory can't)
+ */
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t uffd_ioctls_mask = 1ULL << _UFFDIO_WRITEPROTECT;
+    RAMBlock *block;
+    bool ret = false;
+    int uffd_fd;
+
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
+    if (uffd_fd < 0) {
+        return false;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            uint64_t uffd_ioctls;
+
+            if (!ram_block_is_write_tracked(block)) {
+                continue;
+            }
+            if (uffd_register_memory(uffd_fd, block->host, block->max_length,
+                                     UFFDIO_REGISTER_MODE_WP, &uffd_ioctls) ||
+                (uffd_ioctls & uffd_ioctls_mask) != uffd_ioctls_mask) {
+                goto out;
+            }
+        }
+        ret = true;
+    }
+
+out:
+    uffd_close_fd(uffd_fd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_prepare: get guest RAM ready to be write protected
+ *
+ * Write protection only sticks to pages that are mapped, so read every
+ * page once; unpopulated ones get the zero page.  Ballooning stays
+ * inhibited from now on, so that pages can't be discarded and come back
+ * unprotected.  Called with the VM still running, to keep this out of the
+ * downtime.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs) {
+        return;
+    }
+
+    qemu_balloon_inhibit(true);
+    rs->wp_balloon_inhibited = true;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t offset;
+
+        if (!ram_block_is_write_tracked(block)) {
+            continue;
+        }
+        for (offset = 0; offset < block->used_length;
+             offset += block->page_size) {
+            (void)*(volatile uint8_t *)(block->host + offset);
+        }
+    }
+}
+
+/**
+ * ram_write_tracking_start: write protect guest RAM
+ *
+ * Called with the VM stopped.
+ *
+ * Returns 0 for success or -1 in case of error
+ */
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs) {
+        return -1;
+    }
+
+    rs->uffdio_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    if (rs->uffdio_fd < 0) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!ram_block_is_write_tracked(block)) {
+            continue;
+        }
+        if (uffd_register_memory(rs->uffdio_fd, block->host,
+                                 block->max_length, UFFDIO_REGISTER_MODE_WP,
+                                 NULL)) {
+            goto fail;
+        }
+        block->flags |= RAM_UF_WRITEPROTECT;
+        memory_region_ref(block->mr);
+
+        if (uffd_change_protection(rs->uffdio_fd, block->host,
+                                   block->used_length, true, false)) {
+            goto fail;
+        }
+        trace_ram_write_tracking_ramblock_start(block->idstr, block->host,
+                                                block->used_length);
+    }
+
+    return 0;
+
+fail:
+    error_report("%s: failed, removing write protection", __func__);
+    ram_write_tracking_stop();
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: remove the write protection from guest RAM
+ *
+ * This wakes up all the threads blocked on a write.  Safe to call when
+ * tracking wasn't started or was stopped already.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs) {
+        return;
+    }
+
+    if (rs->uffdio_fd >= 0) {
+        RCU_READ_LOCK_GUARD();
+
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+                continue;
+            }
+            uffd_change_protection(rs->uffdio_fd, block->host,
+                                   block->used_length, false, false);
+            uffd_unregister_memory(rs->uffdio_fd, block->host,
+                                   block->max_length);
+            trace_ram_write_tracking_ramblock_stop(block->idstr, block->host,
+                                                   block->used_length);
+            block->flags &= ~RAM_UF_WRITEPROTECT;
+            memory_region_unref(block->mr);
+        }
+
+        uffd_close_fd(rs->uffdio_fd);
+        rs->uffdio_fd = -1;
+        rs->wp_release_len = 0;
+    }
+
+    if (rs->wp_balloon_inhibited) {
+        qemu_balloon_inhibit(false);
+        rs->wp_balloon_inhibited = false;
+    }
+}
+#else
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    return 0;
+}
+
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    return NULL;
+}
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    assert(0);
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+    assert(0);
+}
+
+int ram_write_tracking_start(void)
+{
+    assert(0);
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+    assert(0);
+}
+#endif /* CONFIG_LINUX */
+
 /**
  * unqueue_page: gets a page of the queue
  *
@@ -2396,6 +1775,14 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     } while (block && !dirty);
 
+    if (!block) {
+        /*
+         * In a background snapshot, guest writes to pages that were not
+         * saved yet are blocked until we save them; serve those first.
+         */
+        block = poll_fault_page(rs, &offset);
+    }
+
     if (block) {
         /*
          * As soon as we start servicing pages out of order, then we have
@@ -2562,6 +1949,125 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
+/*
+ * Mapped-ram file layout, for each RAMBlock: a header in the stream, after
+ * the block's id and length, that gives the offsets of the block's page
+ * bitmap and of its pages in the file.  Each page has a fixed place in the
+ * pages region, which is aligned so that it can be read with O_DIRECT or
+ * mapped; the stream resumes after it.  The bitmaps are only written at
+ * the end, so that they describe the last copy of each page.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+#define MAPPED_RAM_HDR_SIZE 24
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT (1 << 20)
+/* Largest write of contiguous pages */
+#define MAPPED_RAM_MAX_WRITE (4 << 20)
+/* Pages are loaded by threads in chunks of this many bytes */
+#define MAPPED_RAM_LOAD_CHUNK (16 << 20)
+
+/* Size of the bitmap in the file, a whole number of le64 words */
+static size_t mapped_ram_bitmap_size(unsigned long num_pages)
+{
+    return DIV_ROUND_UP(num_pages, 64) * sizeof(uint64_t);
+}
+
+static void mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    int64_t header_offset = qemu_get_offset(f);
+
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(num_pages);
+    block->bitmap_offset = header_offset + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(num_pages),
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be32(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    trace_mapped_ram_setup_ramblock(block->idstr, block->bitmap_offset,
+                                    block->pages_offset);
+
+    /* The stream carries on after the pages */
+    qemu_set_offset(f, block->pages_offset + block->used_length);
+}
+
+/**
+ * mapped_ram_flush: write out the pending run of pages
+ *
+ * @rs: current RAM state
+ */
+static void mapped_ram_flush(RAMState *rs)
+{
+    RAMBlock *block = rs->mapped_ram_block;
+
+    if (!rs->mapped_ram_len) {
+        return;
+    }
+
+    qemu_put_buffer_at(rs->f, block->host + rs->mapped_ram_offset,
+                       rs->mapped_ram_len,
+                       block->pages_offset + rs->mapped_ram_offset);
+    rs->mapped_ram_len = 0;
+}
+
+/**
+ * mapped_ram_save_page: save a page at its place in the file
+ *
+ * Contiguous pages are written together by mapped_ram_flush().  Zero
+ * pages are not written, only cleared in the bitmap.
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ */
+static int mapped_ram_save_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+
+    if (is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    if (!rs->mapped_ram_len || rs->mapped_ram_block != block ||
+        rs->mapped_ram_offset + rs->mapped_ram_len != offset ||
+        rs->mapped_ram_len >= MAPPED_RAM_MAX_WRITE) {
+        mapped_ram_flush(rs);
+        rs->mapped_ram_block = block;
+        rs->mapped_ram_offset = offset;
+    }
+    rs->mapped_ram_len += TARGET_PAGE_SIZE;
+
+    ram_counters.normal++;
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    return 1;
+}
+
+static void mapped_ram_save_bitmaps(RAMState *rs)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t size = mapped_ram_bitmap_size(num_pages);
+        unsigned long *le_bitmap = g_malloc0(size);
+
+        bitmap_to_le(le_bitmap, block->file_bmap, num_pages);
+        qemu_put_buffer_at(rs->f, (uint8_t *)le_bitmap, size,
+                           block->bitmap_offset);
+        g_free(le_bitmap);
+    }
+}
+
 /**
  * ram_save_target_page: save one target page
  *
@@ -2576,6 +2082,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -2586,6 +2093,28 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    if (migrate_mapped_ram()) {
+        return mapped_ram_save_page(rs, block, offset);
+    }
+
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy as one whole host page should be placed
+     */
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd() &&
+                  !migration_in_postcopy();
+
+    /*
+     * The multifd channels look for zero pages themselves, leaving this
+     * thread to just walk the dirty bitmap.  XBZRLE is never used for
+     * pages sent through multifd, so its cache need not be told.
+     */
+    if (use_multifd && migrate_get_current()->multifd_zero_page) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2600,20 +2129,110 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
     return ram_save_page(rs, pss, last_stage);
 }
 
+static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
+                              bool last_stage);
+
+/*
+ * Returns the postcopy preempt channel if urgent pages should be sent on
+ * it, or NULL if they go on the main channel.  Only the migration thread
+ * sets and uses it, so no locking is needed.
+ */
+static QEMUFile *postcopy_preempt_file(void)
+{
+    QEMUFile *f = migrate_get_current()->postcopy_qemufile_src;
+
+    if (!f || !migration_in_postcopy() || qemu_file_get_error(f)) {
+        return NULL;
+    }
+    return f;
+}
+
+/**
+ * postcopy_preempt_send_urgent: send the queued page requests on the
+ * postcopy preempt channel
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @bg: background scan that is in the middle of a host page, or NULL
+ * @last_stage: if we are at the completion stage
+ */
+static int postcopy_preempt_send_urgent(RAMState *rs, PageSearchStatus *bg,
+                                        bool last_stage)
+{
+    QEMUFile *f = postcopy_preempt_file();
+    QEMUFile *main_f = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    PageSearchStatus pss;
+    int tmppages, pages = 0, ret;
+
+    if (!f || rs->postcopy_preempting ||
+        QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
+        return 0;
+    }
+
+    rs->postcopy_preempting = true;
+    rs->f = f;
+    rs->last_sent_block = rs->postcopy_last_sent_block;
+
+    while (get_queued_page(rs, &pss)) {
+        if (bg && pss.block == bg->block) {
+            size_t pagesize_bits =
+                qemu_ram_pagesize(pss.block) >> TARGET_PAGE_BITS;
+
+            /*
+             * The main channel is halfway through this host page and
+             * will finish it next; the destination must receive each host
+             * page whole on a single channel.
+             */
+            if (pss.page / pagesize_bits == bg->page / pagesize_bits) {
+                trace_postcopy_preempt_skip_page(pss.block->idstr,
+                                                 pss.page);
+                continue;
+            }
+        }
+
+        trace_postcopy_preempt_send_page(pss.block->idstr, pss.page);
+        tmppages = ram_save_host_page(rs, &pss, last_stage);
+        if (tmppages < 0) {
+            pages = tmppages;
+            break;
+        }
+        pages += tmppages;
+    }
+
+    /* Close the batch, an empty one would end the stream */
+    if (pages > 0) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    }
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+
+    rs->postcopy_last_sent_block = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_f;
+    rs->postcopy_preempting = false;
+
+    if (ret) {
+        /*
+         * Pages may have been lost on the way; fail the main channel as
+         * well so that postcopy recovery can resend them.
+         */
+        error_report("%s: postcopy preempt channel failed: %d", __func__, ret);
+        qemu_file_set_error(main_f, ret);
+        return ret;
+    }
+
+    return pages;
+}
+
 /**
  * ram_save_host_page: save a whole host page
  *
@@ -2638,6 +2257,8 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
+    int res;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
@@ -2658,15 +2279,31 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
 
         pages += tmppages;
         pss->page++;
+        if (rs->postcopy_preempting) {
+            continue;
+        }
         /* Allow rate limiting to happen in the middle of huge pages */
         migration_rate_limit();
+        /*
+         * Don't make the destination wait for the rest of a huge page
+         * before its faulting pages go out on the preempt channel.
+         */
+        if (pss->page & (pagesize_bits - 1)) {
+            tmppages = postcopy_preempt_send_urgent(rs, pss, last_stage);
+            if (tmppages < 0) {
+                return tmppages;
+            }
+            pages += tmppages;
+        }
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block,
                                 ((ram_addr_t)pss->page) << TARGET_PAGE_BITS));
 
     /* The offset we leave with is the last one we looked at */
     pss->page--;
-    return pages;
+
+    res = ram_save_release_protection(rs, pss, start_page);
+    return res < 0 ? res : pages;
 }
 
 /**
@@ -2703,6 +2340,12 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
     }
 
+    /* Requested pages go first, on their own channel if we have one */
+    pages = postcopy_preempt_send_urgent(rs, NULL, last_stage);
+    if (pages) {
+        return pages;
+    }
+
     do {
         again = true;
         found = get_queued_page(rs, &pss);
@@ -2806,13 +2449,17 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against the migration bitmap
      */
-    memory_global_dirty_log_stop();
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2824,6 +2471,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -3209,6 +2857,7 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -3268,8 +2917,14 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
-        memory_global_dirty_log_start();
-        migration_bitmap_sync_precopy(rs);
+        /*
+         * A background snapshot saves each page before the guest can
+         * change it, so it doesn't need the dirty log.
+         */
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_start();
+            migration_bitmap_sync_precopy(rs);
+        }
     }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -3312,6 +2967,7 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     /*
@@ -3392,6 +3048,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    int ret;
 
     if (compress_threads_save_setup()) {
         return -1;
@@ -3420,13 +3077,20 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                mapped_ram_setup_ramblock(f, block);
+            }
         }
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
-    multifd_send_sync_main(*rsp);
+    ret = multifd_send_sync_main((*rsp)->f);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3515,6 +3179,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
             }
             i++;
         }
+
+        mapped_ram_flush(rs);
     }
 
     /*
@@ -3524,7 +3190,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
 out:
-    multifd_send_sync_main(rs);
+    ret = multifd_send_sync_main(rs->f);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
     ram_counters.transferred += 8;
@@ -3551,11 +3221,16 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     RAMState **temp = opaque;
     RAMState *rs = *temp;
+    QEMUFile *preempt_f;
+    int64_t start_us;
     int ret = 0;
 
     WITH_RCU_READ_LOCK_GUARD() {
         if (!migration_in_postcopy()) {
+            start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
             migration_bitmap_sync_precopy(rs);
+            migration_timings_add(false, MIGRATION_TIMING_PHASE_BITMAP_SYNC,
+                                  NULL, 0, start_us);
         }
 
         ram_control_before_iterate(f, RAM_CONTROL_FINISH);
@@ -3579,9 +3254,29 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+        if (migrate_mapped_ram()) {
+            mapped_ram_flush(rs);
+            mapped_ram_save_bitmaps(rs);
+        }
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = multifd_send_sync_main(rs->f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    preempt_f = postcopy_preempt_file();
+    if (preempt_f) {
+        /* An empty batch lets the preempt thread on the destination quit */
+        qemu_put_be64(preempt_f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(preempt_f);
     }
 
-    multifd_send_sync_main(rs);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3660,14 +3355,18 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel the page came in on, each one tracks its own block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        block = mis->last_recv_block[channel];
         if (!block) {
             error_report("Ack, bad migration stream!");
             return NULL;
@@ -3680,6 +3379,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
     id[len] = 0;
 
     block = qemu_ram_block_by_name(id);
+    mis->last_recv_block[channel] = block;
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -4017,6 +3717,11 @@ void colo_release_ram_cache(void)
  */
 static int ram_load_setup(QEMUFile *f, void *opaque)
 {
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("Mapped-ram requires a seekable migration file");
+        return -1;
+    }
+
     if (compress_threads_load_setup(f)) {
         return -1;
     }
@@ -4067,19 +3772,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by
+ * ram_load_postcopy_preempt() for the preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_PRECOPY or RAM_CHANNEL_POSTCOPY
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *this_host = NULL;
     bool all_zero = false;
     int target_pages = 0;
@@ -4111,7 +3818,11 @@ static int ram_load_postcopy(QEMUFile *f)
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
+            if (!block) {
+                ret = -EINVAL;
+                break;
+            }
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -4243,6 +3954,44 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load the pages sent on the postcopy preempt
+ * channel
+ *
+ * The source sends the requested pages in batches that each end with
+ * RAM_SAVE_FLAG_EOS, and ends the stream with an empty batch.  The RCU
+ * read lock is only held while a batch is loaded, never while waiting
+ * for the next one.
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * @f: QEMUFile of the preempt channel, must be blocking
+ */
+int ram_load_postcopy_preempt(QEMUFile *f)
+{
+    uint8_t *buf;
+    int ret;
+
+    while (true) {
+        if (qemu_peek_buffer(f, &buf, sizeof(uint64_t), 0) !=
+            sizeof(uint64_t)) {
+            ret = qemu_file_get_error(f);
+            return ret ? ret : -EIO;
+        }
+        if (ldq_be_p(buf) == RAM_SAVE_FLAG_EOS) {
+            qemu_file_skip(f, sizeof(uint64_t));
+            return 0;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+}
+
 static bool postcopy_is_advised(void)
 {
     PostcopyState ps = postcopy_state_get();
@@ -4307,6 +4056,160 @@ static void colo_flush_ram_cache(void)
  *
  * @f: QEMUFile where to send the data
  */
+typedef struct MappedRamLoad {
+    QEMUFile *f;
+    RAMBlock *block;
+    unsigned long *bitmap;
+    unsigned long num_pages;
+    int64_t pages_offset;
+    /* Next page to hand out to a thread */
+    unsigned long next_page;
+    /* First error */
+    int ret;
+} MappedRamLoad;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoad *load = opaque;
+    unsigned long chunk_pages = MAPPED_RAM_LOAD_CHUNK >> TARGET_PAGE_BITS;
+    uint8_t *host = load->block->host;
+
+    while (!atomic_read(&load->ret)) {
+        unsigned long start = atomic_fetch_add(&load->next_page, chunk_pages);
+        unsigned long end, page, run_end;
+
+        if (start >= load->num_pages) {
+            break;
+        }
+        end = MIN(start + chunk_pages, load->num_pages);
+
+        for (page = start; page < end; page = run_end) {
+            if (test_bit(page, load->bitmap)) {
+                Error *local_err = NULL;
+                ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+                int ret;
+
+                run_end = find_next_zero_bit(load->bitmap, end, page);
+                ret = qemu_get_buffer_at(load->f, host + offset,
+                                         (size_t)(run_end - page) <<
+                                         TARGET_PAGE_BITS,
+                                         load->pages_offset + offset,
+                                         &local_err);
+                if (ret) {
+                    if (!atomic_cmpxchg(&load->ret, 0, ret)) {
+                        error_report_err(local_err);
+                    } else {
+                        error_free(local_err);
+                    }
+                    return NULL;
+                }
+            } else {
+                /* Pages missing from the file are zero */
+                run_end = find_next_bit(load->bitmap, end, page);
+                for (; page < run_end; page++) {
+                    ram_handle_compressed(host + ((ram_addr_t)page <<
+                                                  TARGET_PAGE_BITS),
+                                          0, TARGET_PAGE_SIZE);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * mapped_ram_load_ramblock: load the pages of a block from a mapped-ram
+ * file
+ *
+ * The header that follows the block in the stream gives where its pages
+ * are; they are read with multifd-channels threads, then the stream is
+ * moved past them.
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @f: QEMUFile where to receive the data
+ * @block: RAMBlock to load
+ * @length: length of the block in the stream
+ */
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    MappedRamLoad load = {
+        .f = f,
+        .block = block,
+        .num_pages = length >> TARGET_PAGE_BITS,
+    };
+    int nthreads = MAX(migrate_multifd_channels(), 1);
+    QemuThread *threads;
+    uint32_t version, page_size;
+    int64_t bitmap_offset;
+    unsigned long *le_bitmap;
+    size_t bitmap_size;
+    Error *local_err = NULL;
+    int i, ret;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be32(f);
+    bitmap_offset = qemu_get_be64(f);
+    load.pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram header version %" PRIu32
+                     " for block %s", version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %s %" PRIu32
+                     " != %d", block->idstr, page_size, TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+    if (!QEMU_IS_ALIGNED(load.pages_offset,
+                         MAPPED_RAM_FILE_OFFSET_ALIGNMENT)) {
+        error_report("Misaligned mapped-ram pages for block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    trace_mapped_ram_load_ramblock(block->idstr, bitmap_offset,
+                                   load.pages_offset, nthreads);
+
+    bitmap_size = mapped_ram_bitmap_size(load.num_pages);
+    le_bitmap = g_malloc0(bitmap_size);
+    ret = qemu_get_buffer_at(f, (uint8_t *)le_bitmap, bitmap_size,
+                             bitmap_offset, &local_err);
+    if (ret) {
+        error_report_err(local_err);
+        g_free(le_bitmap);
+        return ret;
+    }
+    load.bitmap = bitmap_new(load.num_pages);
+    bitmap_from_le(load.bitmap, le_bitmap, load.num_pages);
+    g_free(le_bitmap);
+
+    threads = g_new0(QemuThread, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "mapped-ram-load",
+                           mapped_ram_load_thread, &load,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+    g_free(load.bitmap);
+
+    if (load.ret) {
+        return load.ret;
+    }
+
+    return qemu_set_offset(f, load.pages_offset + length);
+}
+
 static int ram_load_precopy(QEMUFile *f)
 {
     int flags = 0, ret = 0, invalid_flags = 0, len = 0, i = 0;
@@ -4347,7 +4250,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -4421,6 +4325,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4506,7 +4413,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
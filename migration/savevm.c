@@ -41,6 +41,7 @@
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
+#include "timings.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
 #include "qapi/qapi-commands-misc.h"
@@ -875,13 +876,227 @@ void vmstate_unregister(VMStateIf *obj, const VMStateDescription *vmsd,
     }
 }
 
-static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
+/*
+ * The post_load of devices that set threaded_post_load is run by a pool
+ * of worker threads, while the main thread goes on parsing the stream.
+ * Each call to qemu_loadvm_state_main has its own pool, whose threads
+ * are only started once a device needs them.
+ */
+typedef struct LoadvmPostLoadJob {
+    SaveStateEntry *se;
+    int version_id;
+    QSIMPLEQ_ENTRY(LoadvmPostLoadJob) next;
+} LoadvmPostLoadJob;
+
+typedef struct LoadvmPostLoadPool {
+    QemuMutex lock;
+    /* signalled when a job is queued or the threads should quit */
+    QemuCond work_cond;
+    /* signalled when the last pending job completes */
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, LoadvmPostLoadJob) jobs;
+    QemuThread *threads;
+    int nr_threads;
+    /* queued and running jobs */
+    int pending;
+    /* highest priority of the pending jobs */
+    MigrationPriority priority;
+    /* first error returned by a post_load, and the device that failed */
+    int ret;
+    char *failed_idstr;
+    uint32_t failed_instance_id;
+    bool quit;
+} LoadvmPostLoadPool;
+
+static void *loadvm_post_load_thread(void *opaque)
+{
+    LoadvmPostLoadPool *pool = opaque;
+    LoadvmPostLoadJob *job;
+    SaveStateEntry *se;
+    int64_t start;
+    int ret;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&pool->jobs);
+        if (!job) {
+            if (pool->quit) {
+                break;
+            }
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&pool->jobs, next);
+        qemu_mutex_unlock(&pool->lock);
+
+        se = job->se;
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        ret = se->vmsd->post_load(se->opaque, job->version_id);
+        trace_loadvm_post_load_thread(se->idstr, se->instance_id, ret,
+                                      qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                      start);
+        migration_timings_add(true, MIGRATION_TIMING_PHASE_POST_LOAD,
+                              se->idstr, se->instance_id, start);
+        g_free(job);
+
+        qemu_mutex_lock(&pool->lock);
+        if (ret < 0 && !pool->ret) {
+            pool->ret = ret;
+            pool->failed_idstr = g_strdup(se->idstr);
+            pool->failed_instance_id = se->instance_id;
+        }
+        if (--pool->pending == 0) {
+            qemu_cond_broadcast(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static bool loadvm_post_load_threaded(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->threaded_post_load && se->vmsd->post_load &&
+           se->load_version_id >= se->vmsd->minimum_version_id &&
+           migrate_get_current()->post_load_threads;
+}
+
+static void loadvm_post_load_submit(LoadvmPostLoadPool *pool,
+                                    SaveStateEntry *se)
+{
+    LoadvmPostLoadJob *job = g_new0(LoadvmPostLoadJob, 1);
+    int i;
+
+    if (!pool->threads) {
+        qemu_mutex_init(&pool->lock);
+        qemu_cond_init(&pool->work_cond);
+        qemu_cond_init(&pool->done_cond);
+        QSIMPLEQ_INIT(&pool->jobs);
+        pool->pending = 0;
+        pool->ret = 0;
+        pool->failed_idstr = NULL;
+        pool->quit = false;
+        pool->nr_threads = migrate_get_current()->post_load_threads;
+        pool->threads = g_new0(QemuThread, pool->nr_threads);
+        for (i = 0; i < pool->nr_threads; i++) {
+            qemu_thread_create(&pool->threads[i], "loadvm/post_load",
+                               loadvm_post_load_thread, pool,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+
+    job->se = se;
+    job->version_id = se->load_version_id;
+
+    qemu_mutex_lock(&pool->lock);
+    if (!pool->pending || save_state_priority(se) > pool->priority) {
+        pool->priority = save_state_priority(se);
+    }
+    pool->pending++;
+    QSIMPLEQ_INSERT_TAIL(&pool->jobs, job, next);
+    qemu_cond_signal(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for all the pending post_load jobs if any of them has a priority
+ * higher than @priority, or unconditionally if @priority is negative.
+ * Returns the first error of the jobs, or 0; the device that failed is
+ * reported here, since the section being loaded has nothing to do with it.
+ */
+static int loadvm_post_load_drain(LoadvmPostLoadPool *pool, int priority)
+{
+    int64_t start;
+    int ret;
+
+    if (!pool->threads) {
+        return 0;
+    }
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    qemu_mutex_lock(&pool->lock);
+    if (priority < 0 || (pool->pending && pool->priority > priority)) {
+        while (pool->pending) {
+            qemu_cond_wait(&pool->done_cond, &pool->lock);
+        }
+    }
+    ret = pool->ret;
+    pool->ret = 0;
+    qemu_mutex_unlock(&pool->lock);
+    trace_loadvm_post_load_drain(priority,
+                                 qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                 start);
+
+    if (ret < 0) {
+        error_report("error while running post_load for instance 0x%"PRIx32
+                     " of device '%s'", pool->failed_instance_id,
+                     pool->failed_idstr);
+        g_free(pool->failed_idstr);
+        pool->failed_idstr = NULL;
+    }
+    return ret;
+}
+
+/* Wait for the pending post_load jobs and stop the pool's threads */
+static int loadvm_post_load_finish(LoadvmPostLoadPool *pool)
 {
+    int ret = loadvm_post_load_drain(pool, -1);
+    int i;
+
+    if (!pool->threads) {
+        return ret;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    g_free(pool->threads);
+    pool->threads = NULL;
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+
+    return ret;
+}
+
+static int vmstate_load(QEMUFile *f, SaveStateEntry *se,
+                        LoadvmPostLoadPool *pool, uint8_t section_type)
+{
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    bool threaded = false;
+    int ret;
+
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
     if (!se->vmsd) {         /* Old style */
-        return se->ops->load_state(f, se->opaque, se->load_version_id);
+        ret = se->ops->load_state(f, se->opaque, se->load_version_id);
+    } else if (loadvm_post_load_threaded(se)) {
+        ret = vmstate_load_state_no_post_load(f, se->vmsd, se->opaque,
+                                              se->load_version_id);
+        threaded = ret >= 0;
+    } else {
+        ret = vmstate_load_state(f, se->vmsd, se->opaque,
+                                 se->load_version_id);
     }
-    return vmstate_load_state(f, se->vmsd, se->opaque, se->load_version_id);
+    trace_vmstate_load_time(se->idstr, se->instance_id, threaded,
+                            qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
+    /* Only the last part of iterative devices is loaded in the downtime */
+    if (section_type == QEMU_VM_SECTION_FULL ||
+        section_type == QEMU_VM_SECTION_END) {
+        migration_timings_add(true, MIGRATION_TIMING_PHASE_LOAD_DEVICE,
+                              se->idstr, se->instance_id, start);
+    }
+
+    if (threaded) {
+        loadvm_post_load_submit(pool, se);
+    }
+    return ret;
 }
 
 static void vmstate_save_old_style(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
@@ -1306,6 +1521,7 @@ static bool should_send_vmdesc(void)
 void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start_us;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1322,7 +1538,10 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
+        start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_complete_postcopy(f, se->opaque);
+        migration_timings_add(false, MIGRATION_TIMING_PHASE_SAVE_ITERABLE,
+                              se->idstr, se->instance_id, start_us);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
@@ -1339,6 +1558,7 @@ static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     SaveStateEntry *se;
+    int64_t start_us;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1358,7 +1578,10 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
+        start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        migration_timings_add(false, MIGRATION_TIMING_PHASE_SAVE_ITERABLE,
+                              se->idstr, se->instance_id, start_us);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
@@ -1370,7 +1593,6 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
-static
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
@@ -1378,6 +1600,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     g_autoptr(QJSON) vmdesc = NULL;
     int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start_us;
     int ret;
 
     vmdesc = qjson_new();
@@ -1400,7 +1623,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
+        start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = vmstate_save(f, se, vmdesc);
+        migration_timings_add(false, MIGRATION_TIMING_PHASE_SAVE_DEVICE,
+                              se->idstr, se->instance_id, start_us);
         if (ret) {
             qemu_file_set_error(f, ret);
             return ret;
@@ -1414,7 +1640,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_invalidate_cache_all() on the other end won't fail. */
+        start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = bdrv_inactivate_all();
+        migration_timings_add(false, MIGRATION_TIMING_PHASE_INACTIVATE_DISKS,
+                              NULL, 0, start_us);
         if (ret) {
             error_report("%s: bdrv_inactivate_all() failed (%d)",
                          __func__, ret);
@@ -1446,6 +1675,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     int ret;
     Error *local_err = NULL;
     bool in_postcopy = migration_in_postcopy();
+    int64_t start_us;
 
     if (precopy_notify(PRECOPY_NOTIFY_COMPLETE, &local_err)) {
         error_report_err(local_err);
@@ -1453,7 +1683,10 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
 
     trace_savevm_state_complete_precopy();
 
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     cpu_synchronize_all_states();
+    migration_timings_add(false, MIGRATION_TIMING_PHASE_SYNC_CPU_STATE, NULL, 0,
+                          start_us);
 
     if (!in_postcopy || iterable_only) {
         ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
@@ -1473,7 +1706,10 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     }
 
 flush:
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     qemu_fflush(f);
+    migration_timings_add(false, MIGRATION_TIMING_PHASE_FLUSH, NULL, 0,
+                          start_us);
     return 0;
 }
 
@@ -1860,6 +2096,10 @@ static void *postcopy_ram_listen_thread(void *opaque)
     if (load_res < 0) {
         error_report("%s: loadvm failed: %d", __func__, load_res);
         qemu_file_set_error(f, load_res);
+        /* Don't wait for the source to end the preempt channel */
+        if (mis->postcopy_qemufile_dst) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
         migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_ACTIVE,
                                        MIGRATION_STATUS_FAILED);
     } else {
@@ -1948,6 +2188,11 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
     qemu_sem_wait(&mis->listen_thread_sem);
     qemu_sem_destroy(&mis->listen_thread_sem);
 
+    if (migrate_postcopy_preempt()) {
+        /* Unless the preempt channel has yet to connect */
+        postcopy_preempt_thread_start(mis);
+    }
+
     return 0;
 }
 
@@ -1955,6 +2200,7 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
 {
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
+    int64_t start_us;
 
     /* TODO we should move all of this lot into postcopy_ram.c or a shared code
      * in migration.c
@@ -1978,6 +2224,7 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
 
     dirty_bitmap_mig_before_vm_start();
 
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     if (autostart) {
         /* Hold onto your hats, starting the CPU */
         vm_start();
@@ -1985,6 +2232,8 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
         /* leave it paused and let management decide when to start the CPU */
         runstate_set(RUN_STATE_PAUSED);
     }
+    migration_timings_add(true, MIGRATION_TIMING_PHASE_START_VM, NULL, 0,
+                          start_us);
 
     qemu_bh_delete(mis->bh);
 }
@@ -2265,7 +2514,8 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
 }
 
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               LoadvmPostLoadPool *pool, uint8_t section_type)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2316,7 +2566,13 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
-    ret = vmstate_load(f, se);
+    /* Devices may depend on all those of higher priority being loaded */
+    ret = loadvm_post_load_drain(pool, save_state_priority(se));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vmstate_load(f, se, pool, section_type);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
                      " device '%s'", instance_id, idstr);
@@ -2330,7 +2586,8 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
 }
 
 static int
-qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis,
+                             LoadvmPostLoadPool *pool, uint8_t section_type)
 {
     uint32_t section_id;
     SaveStateEntry *se;
@@ -2356,7 +2613,12 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
-    ret = vmstate_load(f, se);
+    ret = loadvm_post_load_drain(pool, save_state_priority(se));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vmstate_load(f, se, pool, section_type);
     if (ret < 0) {
         error_report("error while loading state section id %d(%s)",
                      section_id, se->idstr);
@@ -2484,6 +2746,7 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    LoadvmPostLoadPool pool = {};
     uint8_t section_type;
     int ret = 0;
 
@@ -2500,19 +2763,25 @@ retry:
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            ret = qemu_loadvm_section_start_full(f, mis, &pool,
+                                                 section_type);
             if (ret < 0) {
                 goto out;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
-            ret = qemu_loadvm_section_part_end(f, mis);
+            ret = qemu_loadvm_section_part_end(f, mis, &pool, section_type);
             if (ret < 0) {
                 goto out;
             }
             break;
         case QEMU_VM_COMMAND:
+            /* Commands may start the VM or load more devices */
+            ret = loadvm_post_load_drain(&pool, -1);
+            if (ret < 0) {
+                goto out;
+            }
             ret = loadvm_process_command(f);
             trace_qemu_loadvm_state_section_command(ret);
             if ((ret < 0) || (ret == LOADVM_QUIT)) {
@@ -2530,6 +2799,11 @@ retry:
     }
 
 out:
+    if (ret < 0) {
+        loadvm_post_load_finish(&pool);
+    } else {
+        ret = loadvm_post_load_finish(&pool);
+    }
     if (ret < 0) {
         qemu_file_set_error(f, ret);
 
@@ -2561,6 +2835,7 @@ int qemu_loadvm_state(QEMUFile *f)
         return -EINVAL;
     }
 
+    migration_timings_reset(true);
     ret = qemu_loadvm_state_header(f);
     if (ret) {
         return ret;
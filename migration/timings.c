@@ -0,0 +1,87 @@
+/*
+ * Migration phase timings
+ *
+ * The time spent in each phase of the downtime window, and on each
+ * device, is kept for the last outgoing and the last incoming migration
+ * so that query-migrate-timings can tell where the downtime went.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "timings.h"
+#include "trace.h"
+
+/*
+ * Phases are recorded by the migration thread, the main thread and the
+ * post_load worker threads, so the lists are protected by a mutex.
+ */
+static struct {
+    QemuMutex lock;
+    MigrationTimingList *list[2];
+    MigrationTimingList **tail[2];
+} timings;
+
+static void __attribute__((constructor)) migration_timings_init(void)
+{
+    qemu_mutex_init(&timings.lock);
+    timings.tail[false] = &timings.list[false];
+    timings.tail[true] = &timings.list[true];
+}
+
+void migration_timings_reset(bool incoming)
+{
+    MigrationTimingList *list;
+
+    qemu_mutex_lock(&timings.lock);
+    list = timings.list[incoming];
+    timings.list[incoming] = NULL;
+    timings.tail[incoming] = &timings.list[incoming];
+    qemu_mutex_unlock(&timings.lock);
+
+    qapi_free_MigrationTimingList(list);
+}
+
+void migration_timings_add(bool incoming, MigrationTimingPhase phase,
+                           const char *device, uint32_t instance_id,
+                           int64_t start_us)
+{
+    MigrationTimingList *entry = g_new0(MigrationTimingList, 1);
+    MigrationTiming *timing = g_new0(MigrationTiming, 1);
+
+    timing->phase = phase;
+    timing->time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
+    if (device) {
+        timing->has_device = true;
+        timing->device = g_strdup(device);
+        timing->has_instance_id = true;
+        timing->instance_id = instance_id;
+    }
+    entry->value = timing;
+
+    trace_migration_timing(incoming, MigrationTimingPhase_str(phase),
+                           device ? device : "", instance_id, timing->time);
+
+    qemu_mutex_lock(&timings.lock);
+    *timings.tail[incoming] = entry;
+    timings.tail[incoming] = &entry->next;
+    qemu_mutex_unlock(&timings.lock);
+}
+
+MigrationTimings *qmp_query_migrate_timings(Error **errp)
+{
+    MigrationTimings *info = g_new0(MigrationTimings, 1);
+
+    qemu_mutex_lock(&timings.lock);
+    info->outgoing = QAPI_CLONE(MigrationTimingList, timings.list[false]);
+    info->incoming = QAPI_CLONE(MigrationTimingList, timings.list[true]);
+    qemu_mutex_unlock(&timings.lock);
+
+    return info;
+}
@@ -0,0 +1,25 @@
+/*
+ * Migration phase timings
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_TIMINGS_H
+#define QEMU_MIGRATION_TIMINGS_H
+
+#include "qapi/qapi-types-migration.h"
+
+/* Forget the timings of the previous outgoing or @incoming migration */
+void migration_timings_reset(bool incoming);
+
+/*
+ * Record that @phase, which started at @start_us on QEMU_CLOCK_REALTIME,
+ * has just completed.  @device is NULL for phases that are not about a
+ * single device.
+ */
+void migration_timings_add(bool incoming, MigrationTimingPhase phase,
+                           const char *device, uint32_t instance_id,
+                           int64_t start_us);
+
+#endif
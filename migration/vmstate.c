@@ -75,8 +75,10 @@ static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
     }
 }
 
-int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
-                       void *opaque, int version_id)
+static int vmstate_load_state_common(QEMUFile *f,
+                                     const VMStateDescription *vmsd,
+                                     void *opaque, int version_id,
+                                     bool post_load)
 {
     const VMStateField *field = vmsd->fields;
     int ret = 0;
@@ -164,13 +166,32 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
     if (ret != 0) {
         return ret;
     }
-    if (vmsd->post_load) {
+    if (post_load && vmsd->post_load) {
         ret = vmsd->post_load(opaque, version_id);
     }
     trace_vmstate_load_state_end(vmsd->name, "end", ret);
     return ret;
 }
 
+int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
+                       void *opaque, int version_id)
+{
+    return vmstate_load_state_common(f, vmsd, opaque, version_id, true);
+}
+
+/*
+ * Like vmstate_load_state, but the post_load hook of @vmsd itself is left
+ * for the caller to run; those of its structures and subsections are
+ * still called.  @version_id must not need @vmsd->load_state_old.
+ */
+int vmstate_load_state_no_post_load(QEMUFile *f,
+                                    const VMStateDescription *vmsd,
+                                    void *opaque, int version_id)
+{
+    assert(version_id >= vmsd->minimum_version_id);
+    return vmstate_load_state_common(f, vmsd, opaque, version_id, false);
+}
+
 static int vmfield_name_num(const VMStateField *start,
                             const VMStateField *search)
 {
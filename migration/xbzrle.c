@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,17 +25,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -126,6 +124,300 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/*
+ * The vector encoders compare 64 bytes at a time into a bitmap with one
+ * bit per equal byte, and find the end of each run with ctz64.  Runs are
+ * delimited exactly as in xbzrle_encode_buffer_int, and the overflow checks
+ * happen at the same points, so the output is the same byte for byte.
+ */
+typedef int (*xbzrle_run_end_fn)(const uint8_t *old_buf,
+                                 const uint8_t *new_buf,
+                                 int i, int slen, bool equal);
+
+static inline int xbzrle_run_end_tail(const uint8_t *old_buf,
+                                      const uint8_t *new_buf,
+                                      int i, int slen, bool equal)
+{
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen,
+                                     xbzrle_run_end_fn run_end)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, j;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = run_end(old_buf, new_buf, i, slen, true);
+        zrun_len = j - i;
+        i = j;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = run_end(old_buf, new_buf, i, slen, false);
+        nzrun_len = j - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = j;
+    }
+
+    return d;
+}
+
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static inline uint64_t xbzrle_eq_mask16_sse2(const uint8_t *a,
+                                             const uint8_t *b)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)a);
+    __m128i y = _mm_loadu_si128((const __m128i *)b);
+
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+}
+
+static int xbzrle_run_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool equal)
+{
+    uint64_t flip = equal ? -1ULL : 0;
+
+    for (; i + 64 <= slen; i += 64) {
+        uint64_t eq = xbzrle_eq_mask16_sse2(old_buf + i, new_buf + i)
+            | xbzrle_eq_mask16_sse2(old_buf + i + 16, new_buf + i + 16) << 16
+            | xbzrle_eq_mask16_sse2(old_buf + i + 32, new_buf + i + 32) << 32
+            | xbzrle_eq_mask16_sse2(old_buf + i + 48, new_buf + i + 48) << 48;
+
+        if (eq ^ flip) {
+            return i + ctz64(eq ^ flip);
+        }
+    }
+    return xbzrle_run_end_tail(old_buf, new_buf, i, slen, equal);
+}
+
+static int xbzrle_encode_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_run_end_sse2);
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint64_t xbzrle_eq_mask32_avx2(const uint8_t *a,
+                                             const uint8_t *b)
+{
+    __m256i x = _mm256_loadu_si256((const __m256i *)a);
+    __m256i y = _mm256_loadu_si256((const __m256i *)b);
+
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+}
+
+static int xbzrle_run_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool equal)
+{
+    uint64_t flip = equal ? -1ULL : 0;
+
+    for (; i + 64 <= slen; i += 64) {
+        uint64_t eq = xbzrle_eq_mask32_avx2(old_buf + i, new_buf + i)
+            | xbzrle_eq_mask32_avx2(old_buf + i + 32, new_buf + i + 32) << 32;
+
+        if (eq ^ flip) {
+            return i + ctz64(eq ^ flip);
+        }
+    }
+    return xbzrle_run_end_tail(old_buf, new_buf, i, slen, equal);
+}
+
+static int xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_run_end_avx2);
+}
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC target("avx512bw")
+
+static int xbzrle_run_end_avx512bw(const uint8_t *old_buf,
+                                   const uint8_t *new_buf,
+                                   int i, int slen, bool equal)
+{
+    uint64_t flip = equal ? -1ULL : 0;
+
+    for (; i + 64 <= slen; i += 64) {
+        __m512i x = _mm512_loadu_si512(old_buf + i);
+        __m512i y = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(x, y);
+
+        if (eq ^ flip) {
+            return i + ctz64(eq ^ flip);
+        }
+    }
+    return xbzrle_run_end_tail(old_buf, new_buf, i, slen, equal);
+}
+
+static int xbzrle_encode_avx512bw(uint8_t *old_buf, uint8_t *new_buf,
+                                  int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_run_end_avx512bw);
+}
+#endif /* CONFIG_AVX512BW_OPT */
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+#define CACHE_SSE2     4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_avx512bw;
+    }
+#endif
+    encode_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+#ifdef CONFIG_AVX512BW_OPT
+            /* The OS must also save the opmask and upper ZMM state.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+#endif
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define encode_accel xbzrle_encode_buffer_int
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
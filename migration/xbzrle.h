@@ -16,6 +16,11 @@
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
+/*
+ * Switch xbzrle_encode_buffer to the next less preferred accelerated
+ * encoder; returns false once the portable one is in use.  For tests.
+ */
+bool test_xbzrle_encode_next_accel(void);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 #endif
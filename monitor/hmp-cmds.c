@@ -32,12 +32,14 @@
 #include "qapi/qapi-commands-block.h"
 #include "qapi/qapi-commands-char.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-commands-control.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qapi/qapi-commands-net.h"
 #include "qapi/qapi-commands-rocker.h"
 #include "qapi/qapi-commands-run-state.h"
 #include "qapi/qapi-commands-tpm.h"
 #include "qapi/qapi-commands-ui.h"
+#include "qapi/qapi-visit-migration.h"
 #include "qapi/qapi-visit-net.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qerror.h"
@@ -282,6 +284,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->dirty_sync_missed_zero_copy) {
+            monitor_printf(mon, "zero-copy-send fallbacks: %" PRIu64 "\n",
+                           info->ram->dirty_sync_missed_zero_copy);
+        }
     }
 
     if (info->has_disk) {
@@ -304,6 +310,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_evictions);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
@@ -447,6 +457,15 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_CHANNELS),
             params->multifd_channels);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
+            MultiFDCompression_str(params->multifd_compression));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL),
+            params->multifd_zlib_level);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL),
+            params->multifd_zstd_level);
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -467,6 +486,54 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_str(info->status));
+    if (info->status != DIRTY_RATE_STATUS_UNSTARTED) {
+        monitor_printf(mon, "Start Time: %" PRId64 " (s)\n",
+                       info->start_time);
+        monitor_printf(mon, "Period: %" PRId64 " (sec)\n", info->calc_time);
+        monitor_printf(mon, "Sample Pages: %" PRIu64 " (per GiB)\n",
+                       info->sample_pages);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " (MB/s)\n",
+                       info->dirty_rate);
+    } else if (info->status == DIRTY_RATE_STATUS_MEASURING) {
+        monitor_printf(mon, "Dirty rate: (not ready)\n");
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
+static void print_migrate_timings(Monitor *mon, const char *name,
+                                  MigrationTimingList *list)
+{
+    monitor_printf(mon, "%s:\n", name);
+    for (; list; list = list->next) {
+        MigrationTiming *timing = list->value;
+
+        monitor_printf(mon, "  %s", MigrationTimingPhase_str(timing->phase));
+        if (timing->has_device) {
+            monitor_printf(mon, " %s/%" PRIu32, timing->device,
+                           timing->instance_id);
+        }
+        monitor_printf(mon, ": %" PRId64 " us\n", timing->time);
+    }
+}
+
+void hmp_info_migrate_timings(Monitor *mon, const QDict *qdict)
+{
+    MigrationTimings *info = qmp_query_migrate_timings(NULL);
+
+    print_migrate_timings(mon, "Outgoing", info->outgoing);
+    print_migrate_timings(mon, "Incoming", info->incoming);
+
+    qapi_free_MigrationTimings(info);
+}
+
 static void print_block_info(Monitor *mon, BlockInfo *info,
                              BlockDeviceInfo *inserted, bool verbose)
 {
@@ -1699,6 +1766,22 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (!err) {
+        monitor_printf(mon, "Measuring the dirty rate for %" PRId64
+                       " seconds, use 'info dirty_rate' to get the result\n",
+                       sec);
+    }
+    hmp_handle_error(mon, err);
+}
+
 /* Kept for backwards compatibility */
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
@@ -1823,6 +1906,19 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_channels = true;
         visit_type_int(v, param, &p->multifd_channels, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_COMPRESSION:
+        p->has_multifd_compression = true;
+        visit_type_MultiFDCompression(v, param, &p->multifd_compression,
+                                      &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL:
+        p->has_multifd_zlib_level = true;
+        visit_type_int(v, param, &p->multifd_zlib_level, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL:
+        p->has_multifd_zstd_level = true;
+        visit_type_int(v, param, &p->multifd_zstd_level, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         visit_type_size(v, param, &cache_size, &err);
@@ -2351,8 +2447,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, false, NULL,
-                           true, writable, false, NULL, &local_err);
+        qmp_nbd_server_add(info->value->device, false, NULL, true, writable,
+                           false, NULL, false, NULL, &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -2374,7 +2470,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     Error *local_err = NULL;
 
     qmp_nbd_server_add(device, !!name, name, true, writable,
-                       false, NULL, &local_err);
+                       false, NULL, false, NULL, &local_err);
     hmp_handle_error(mon, local_err);
 }
 
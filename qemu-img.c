@@ -1859,6 +1859,32 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Reenter the coroutine that might be waiting for s->wr_offs, either right
+ * away or, if @defer is true, once the calling coroutine yields.
+ */
+static void coroutine_fn convert_wake_next_writer(ImgConvertState *s,
+                                                  bool defer)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            if (defer) {
+                aio_co_wake(s->co[i]);
+            } else {
+                /*
+                 * A -> B -> A cannot occur because A has
+                 * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                 * B will never enter A during this time window.
+                 */
+                qemu_coroutine_enter(s->co[i]);
+            }
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1882,6 +1908,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        bool wr_queued = false;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1942,6 +1969,20 @@ retry:
                     goto retry;
                 }
             } else {
+                if (s->wr_in_order && s->compressed && status == BLK_DATA &&
+                    s->has_zero_init) {
+                    /*
+                     * The target allocates compressed clusters in the order
+                     * in which the writes are submitted, so the next write
+                     * can be submitted as soon as this one is, instead of
+                     * waiting for it to be compressed.  With zero
+                     * initialisation, this is the only kind of write that
+                     * can be issued here.
+                     */
+                    s->wr_offs = sector_num + n;
+                    convert_wake_next_writer(s, true);
+                    wr_queued = true;
+                }
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
             if (ret < 0) {
@@ -1951,21 +1992,11 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !wr_queued) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
             s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_wake_next_writer(s, false);
         }
     }
 
@@ -4187,7 +4218,7 @@ static int img_bench(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
+        c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options, NULL);
         if (c == -1) {
             break;
         }
@@ -4230,6 +4261,14 @@ static int img_bench(int argc, char **argv)
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'i':
+            ret = bdrv_parse_aio(optarg, &flags);
+            if (ret < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                ret = -1;
+                goto out;
+            }
+            break;
         case 'o':
         {
             offset = cvtnum(optarg);
@@ -119,6 +119,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
@@ -140,6 +141,14 @@ irqchip completely is not recommended except for debugging purposes.
 Defines the size of the KVM shadow MMU.
 @item tb-size=@var{n}
 Controls the size (in MiB) of the TCG translation block cache.
+@item dirty-ring-size=@var{n}
+When the KVM accelerator is used, it controls the size of the per-vCPU dirty
+page ring buffer (number of entries for each vCPU).  It should be a value that
+is power of two, and it should be 1024 or bigger (but still less than the
+maximum value that the kernel supports).  4096 could be a good initial value if
+you have no idea which is the best.  Set this value to 0 to disable the feature.
+By default, this feature is disabled (dirty-ring-size=0) and KVM records
+dirty pages in a per-memslot bitmap instead.
 @item thread=single|multi
 Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
@@ -1045,7 +1054,7 @@ This is the protocol-level block driver for accessing regular files.
 @item filename
 The path to the image file in the local filesystem
 @item aio
-Specifies the AIO backend (threads/native, default: threads)
+Specifies the host AIO backend (threads/native/io_uring, default: threads)
 @item locking
 Specifies whether the image file is protected with Linux OFD / POSIX locks. The
 default is to use the Linux Open File Descriptor API if available, otherwise no
@@ -1115,6 +1124,11 @@ Clean unused entries in the L2 and refcount caches. The interval is in seconds.
 The default value is 600 on supporting platforms, and 0 on other platforms.
 Setting it to 0 disables this feature.
 
+@item decompress-cache-size
+The maximum size of the cache of recently decompressed clusters in bytes, which
+avoids decompressing a compressed cluster again for each small read from it
+(default: 2M; 0 disables the cache)
+
 @item pass-discard-request
 Whether discard requests to the qcow2 device should be forwarded to the data
 source (on/off; default: on if discard=unmap is specified, off otherwise)
@@ -1155,7 +1169,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,snapshot=on|off][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -1223,7 +1238,8 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native", or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO, or Linux io_uring API.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -4028,6 +4044,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -4046,6 +4064,10 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Accept incoming migration from a file, as saved by migrating to
+@samp{file:@var{filename}}.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -4972,6 +4994,23 @@ The polling parameters can be modified at run-time using the @code{qom-set} comm
 (qemu) qom-set /objects/iothread1 poll-max-ns 100000
 @end example
 
+@item -object vhost-user-blk-server,id=@var{id},node-name=@var{node},unix-socket=@var{path}[,writable=on|off][,logical-block-size=@var{size}]
+
+Exports the block node @var{node} as a vhost-user-blk device on the UNIX
+domain socket @var{path}, so that a vhost-user-blk device in another
+process (usually a guest) can access it.  One client can be connected at a
+time.  Requests are processed in the AioContext of the block node, so they
+run in an IOThread if the node has been moved to one.
+
+The export is read-only unless @option{writable} is on.  The
+@option{logical-block-size} is reported to the guest and must be a power of
+two between 512 and 32768; it defaults to 512.
+
+This object is available on Linux hosts.  The block node must already exist
+when the object is created, so with @command{qemu-storage-daemon} the
+@option{--blockdev} option for @var{node} has to come before
+@option{--object}; alternatively, create the object with @code{object-add}.
+
 @end table
 
 ETEXI
@@ -220,6 +220,12 @@ class QAPISchemaModularCVisitor(QAPISchemaVisitor):
     def _is_builtin_module(name):
         return not name
 
+    @staticmethod
+    def _is_shared_module(name):
+        # Modules included from outside the schema's directory belong
+        # to another schema, whose build generates their code
+        return name and name.startswith('../')
+
     def _module_dirname(self, what, name):
         if self._is_user_module(name):
             return os.path.dirname(name)
@@ -261,6 +267,8 @@ class QAPISchemaModularCVisitor(QAPISchemaVisitor):
         for name in self._module:
             if self._is_builtin_module(name) and not opt_builtins:
                 continue
+            if self._is_shared_module(name):
+                continue
             (genc, genh) = self._module[name]
             genc.write(output_dir)
             genh.write(output_dir)
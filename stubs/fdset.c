@@ -19,3 +19,7 @@ int monitor_fdset_get_fd(int64_t fdset_id, int flags)
 void monitor_fdset_dup_fd_remove(int dupfd)
 {
 }
+
+void monitor_fdsets_cleanup(void)
+{
+}
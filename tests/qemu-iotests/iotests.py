@@ -34,6 +34,7 @@ from collections import OrderedDict
 
 sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'python'))
 from qemu import qtest
+from qemu.qmp import QEMUMonitorProtocol
 
 assert sys.version_info >= (3,6)
 
@@ -56,6 +57,8 @@ qemu_nbd_args = [os.environ.get('QEMU_NBD_PROG', 'qemu-nbd')]
 if os.environ.get('QEMU_NBD_OPTIONS'):
     qemu_nbd_args += os.environ['QEMU_NBD_OPTIONS'].strip().split(' ')
 
+qsd_prog = os.environ.get('QSD_PROG', '')
+
 qemu_prog = os.environ.get('QEMU_PROG', 'qemu')
 qemu_opts = os.environ.get('QEMU_OPTIONS', '').strip().split(' ')
 
@@ -252,6 +255,35 @@ def qemu_nbd_popen(*args):
     '''Run qemu-nbd in daemon mode and return the parent's exit code'''
     return subprocess.Popen(qemu_nbd_args + ['--persistent'] + list(args))
 
+class QemuStorageDaemon:
+    '''A qemu-storage-daemon process with a QMP monitor on a UNIX socket'''
+    def __init__(self, *args):
+        self._qmp_path = file_path('qsd-qmp.sock', base_dir=sock_dir)
+        self._qmp = QEMUMonitorProtocol(self._qmp_path, server=True)
+        self.args = [qsd_prog,
+                     '--chardev', 'socket,id=qsd-qmp,path=' + self._qmp_path,
+                     '--monitor', 'chardev=qsd-qmp'] + list(args)
+        self._p = subprocess.Popen(self.args)
+        self._qmp.accept()
+
+    def qmp(self, cmd, args=None):
+        return self._qmp.cmd(cmd, args)
+
+    def stop(self):
+        self._qmp.close()
+        self._p.terminate()
+        return self._p.wait()
+
+def qsd_run(*args):
+    '''Run qemu-storage-daemon without a monitor and return both its exit
+       code and its output'''
+    subp = subprocess.Popen([qsd_prog] + list(args),
+                            stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT,
+                            universal_newlines=True)
+    output = subp.communicate()[0]
+    return subp.returncode, output
+
 def compare_images(img1, img2, fmt1=imgfmt, fmt2=imgfmt):
     '''Return True if two image files are identical'''
     return qemu_img('compare', '-f', fmt1,
@@ -941,6 +973,11 @@ def verify_quorum():
     if not supports_quorum():
         notrun('quorum support missing')
 
+def verify_qsd():
+    '''Skip test suite if qemu-storage-daemon has not been built'''
+    if not qsd_prog:
+        notrun('qemu-storage-daemon not found')
+
 def qemu_pipe(*args):
     '''Run qemu with an option to print something and exit (e.g. a help option),
     and return its output'''
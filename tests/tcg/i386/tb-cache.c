@@ -0,0 +1,42 @@
+/*
+ * Guest side of the -tb-cache test
+ *
+ * Generates a function at a fixed address that returns the number given
+ * on the command line and prints what it returns.  Running it again with
+ * a different number puts different guest code at the same pc, which the
+ * translation cache of the previous run must not be used for.
+ *
+ * This works unchanged for i386 and x86_64 guests.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define CODE_ADDR ((void *)0x20000000)
+
+int main(int argc, char **argv)
+{
+    unsigned int value = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    unsigned int (*fn)(void);
+    unsigned char *code;
+
+    code = mmap(CODE_ADDR, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (code == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    code[0] = 0xb8;                 /* mov $value, %eax */
+    memcpy(code + 1, &value, sizeof(value));
+    code[5] = 0xc3;                 /* ret */
+
+    fn = (unsigned int (*)(void))code;
+    printf("%u\n", fn());
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Run a program several times with -tb-cache and check that the
+# translated code is reused, except where the guest code has changed.
+#
+# Usage: tb-cache.sh "QEMU [OPTIONS]" PROGRAM
+#
+# PROGRAM must be tests/tcg/i386/tb-cache.c.
+#
+# License: GNU GPL, version 2 or later.
+#   See the COPYING file in the top-level directory.
+
+qemu="$1"
+prog="$2"
+
+fail()
+{
+    echo "FAIL: $*"
+    exit 1
+}
+
+# The cache is only reused if QEMU is loaded at the same address every time
+if ! setarch "$(uname -m)" -R true 2>/dev/null; then
+    echo "SKIP: cannot disable address space randomization"
+    exit 0
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# $1: log file, $2: program, $3: number for the program to print
+run()
+{
+    setarch "$(uname -m)" -R $qemu -tb-cache "$dir" \
+        -d trace:tb_cache_load,trace:tb_cache_hit,trace:tb_cache_stale \
+        -D "$1" "$2" "$3"
+}
+
+out=$(run "$dir/1.log" "$prog" 1) || fail "first run failed"
+test "$out" = 1 || fail "first run printed '$out'"
+grep -q tb_cache_load "$dir/1.log" && fail "first run loaded a cache"
+
+out=$(run "$dir/2.log" "$prog" 1) || fail "second run failed"
+test "$out" = 1 || fail "second run printed '$out'"
+grep -q tb_cache_load "$dir/2.log" || fail "second run did not load the cache"
+grep -q tb_cache_hit "$dir/2.log" || fail "second run reused no TB"
+grep -q tb_cache_stale "$dir/2.log" && fail "second run found stale TBs"
+
+# Same program, but different guest code at the generated function's pc
+out=$(run "$dir/3.log" "$prog" 2) || fail "third run failed"
+test "$out" = 2 || fail "stale TB was used, third run printed '$out'"
+grep -q tb_cache_stale "$dir/3.log" || fail "third run found no stale TB"
+
+# A modified binary must not load the cache of the original one
+cp "$prog" "$dir/prog" && printf '\0' >> "$dir/prog" || exit 1
+out=$(run "$dir/4.log" "$dir/prog" 3) || fail "modified binary failed"
+test "$out" = 3 || fail "modified binary printed '$out'"
+grep -q tb_cache_load "$dir/4.log" && fail "modified binary loaded a cache"
+
+echo "PASS"
@@ -91,8 +91,61 @@ static void test_io_channel_fd(void)
     object_unref(OBJECT(ioc));
 }
 
+#ifdef CONFIG_PREADV
+static void test_io_channel_file_positioned(void)
+{
+    QIOChannel *ioc;
+    char buf[12] = { 0 };
+    ssize_t ret;
+
+    unlink(TEST_FILE);
+    ioc = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDWR | O_CREAT | O_TRUNC | O_BINARY, TEST_MASK,
+                          &error_abort));
+    g_assert(qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    /* Out of order, leaving the stream position alone */
+    ret = qio_channel_pwrite(ioc, "world", 5, 6, &error_abort);
+    g_assert_cmpint(ret, ==, 5);
+    ret = qio_channel_pwrite(ioc, "hello ", 6, 0, &error_abort);
+    g_assert_cmpint(ret, ==, 6);
+    g_assert_cmpint(qio_channel_io_seek(ioc, 0, SEEK_CUR, &error_abort),
+                    ==, 0);
+
+    ret = qio_channel_pread(ioc, buf, 11, 0, &error_abort);
+    g_assert_cmpint(ret, ==, 11);
+    g_assert_cmpstr(buf, ==, "hello world");
+
+    /* Reading past the end returns 0 */
+    ret = qio_channel_pread(ioc, buf, 1, 11, &error_abort);
+    g_assert_cmpint(ret, ==, 0);
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(ioc));
+}
+#endif
+
 
 #ifndef _WIN32
+static void test_io_channel_pipe_positioned(void)
+{
+    QIOChannel *ioc;
+    int fd[2];
+
+    if (pipe(fd) < 0) {
+        perror("pipe");
+        abort();
+    }
+
+    ioc = QIO_CHANNEL(qio_channel_file_new_fd(fd[1]));
+    g_assert(!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+    g_assert_cmpint(qio_channel_pwrite(ioc, "x", 1, 0, NULL), ==, -1);
+
+    object_unref(OBJECT(ioc));
+    close(fd[0]);
+}
+
 static void test_io_channel_pipe(bool async)
 {
     QIOChannel *src, *dst;
@@ -137,9 +190,15 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+#ifdef CONFIG_PREADV
+    g_test_add_func("/io/channel/file/positioned",
+                    test_io_channel_file_positioned);
+#endif
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
+    g_test_add_func("/io/channel/pipe/positioned",
+                    test_io_channel_pipe_positioned);
 #endif
     return g_test_run();
 }
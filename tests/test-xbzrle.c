@@ -13,9 +13,14 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "../migration/xbzrle.h"
 
 #define PAGE_SIZE 4096
+#define ACCEL_PAGES 64
+#define BENCH_PAGES 256
+#define BENCH_ROUNDS 1000
+#define BENCH_RUNS 32
 
 static void test_uleb(void)
 {
@@ -174,6 +179,112 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Modify @nr_runs runs of up to @max_run bytes at random offsets in
+ * @new_buf, which starts out as a copy of @old_buf.
+ */
+static void make_page_pair(uint8_t *old_buf, uint8_t *new_buf,
+                           int nr_runs, int max_run)
+{
+    int i, j, start, len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+
+    for (i = 0; i < nr_runs; i++) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_run + 1);
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            new_buf[j] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+/*
+ * Every accelerated encoder must produce the same output as the portable
+ * one, including where it gives up because the destination is too small.
+ */
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *expected = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int expected_len[ACCEL_PAGES], dlen[ACCEL_PAGES];
+    int i, rc;
+    bool first = true;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        make_page_pair(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE,
+                       g_test_rand_int_range(0, 600),
+                       g_test_rand_int_range(1, 130));
+        dlen[i] = g_test_rand_bit() ? PAGE_SIZE :
+                  g_test_rand_int_range(0, PAGE_SIZE);
+    }
+
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            rc = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                      new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                      compressed, dlen[i]);
+            if (first) {
+                expected_len[i] = rc;
+                if (rc > 0) {
+                    memcpy(expected + i * PAGE_SIZE, compressed, rc);
+                }
+                continue;
+            }
+            g_assert_cmpint(rc, ==, expected_len[i]);
+            if (rc > 0) {
+                g_assert(memcmp(expected + i * PAGE_SIZE, compressed,
+                                rc) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(expected);
+    g_free(compressed);
+}
+
+static void test_encode_speed(void)
+{
+    uint8_t *old_buf = g_malloc(BENCH_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(BENCH_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double total = (double)BENCH_PAGES * PAGE_SIZE * BENCH_ROUNDS;
+    int i, j, accel = 0;
+
+    for (i = 0; i < BENCH_PAGES; i++) {
+        make_page_pair(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE,
+                       BENCH_RUNS, 16);
+    }
+
+    /* From the most preferred encoder down to the portable one */
+    do {
+        g_test_timer_start();
+        for (j = 0; j < BENCH_ROUNDS; j++) {
+            for (i = 0; i < BENCH_PAGES; i++) {
+                xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                     new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                     compressed, PAGE_SIZE);
+            }
+        }
+        g_test_timer_elapsed();
+
+        g_print("encoder %d, %d runs/page: %.2f GB/sec ", accel++,
+                BENCH_RUNS, total / GiB / g_test_timer_last());
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +297,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Both walk down the list of encoders, which cannot be undone */
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_speed", test_encode_speed);
+    } else {
+        g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    }
 
     return g_test_run();
 }
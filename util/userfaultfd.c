@@ -0,0 +1,192 @@
+/*
+ * Linux userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/userfaultfd.h"
+#include "trace.h"
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/**
+ * uffd_query_features: query the features the kernel supports
+ *
+ * Returns 0 on success, -1 in case of error
+ *
+ * @features: where to store the supported features
+ */
+int uffd_query_features(uint64_t *features)
+{
+    struct uffdio_api api_struct = { 0 };
+    int uffd_fd;
+    int ret = -1;
+
+    uffd_fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (uffd_fd < 0) {
+        trace_uffd_query_features_nosys(errno);
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+
+    if (ioctl(uffd_fd, UFFDIO_API, &api_struct)) {
+        trace_uffd_query_features_api_failed(errno);
+        goto out;
+    }
+    *features = api_struct.features;
+    ret = 0;
+
+out:
+    close(uffd_fd);
+    return ret;
+}
+
+/**
+ * uffd_create_fd: create a userfaultfd with the given features enabled
+ *
+ * Returns the new file descriptor, or -1 in case of error
+ *
+ * @features: features to enable
+ * @non_blocking: open it with O_NONBLOCK
+ */
+int uffd_create_fd(uint64_t features, bool non_blocking)
+{
+    struct uffdio_api api_struct = { 0 };
+    uint64_t ioctl_mask = (1ULL << _UFFDIO_REGISTER) |
+                          (1ULL << _UFFDIO_UNREGISTER);
+    int flags = O_CLOEXEC | (non_blocking ? O_NONBLOCK : 0);
+    int uffd_fd;
+
+    uffd_fd = syscall(__NR_userfaultfd, flags);
+    if (uffd_fd < 0) {
+        trace_uffd_create_fd_nosys(errno);
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = features;
+    if (ioctl(uffd_fd, UFFDIO_API, &api_struct)) {
+        trace_uffd_create_fd_api_failed(errno);
+        goto fail;
+    }
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        trace_uffd_create_fd_api_noioctl(ioctl_mask, api_struct.ioctls);
+        goto fail;
+    }
+
+    return uffd_fd;
+
+fail:
+    close(uffd_fd);
+    return -1;
+}
+
+void uffd_close_fd(int uffd_fd)
+{
+    assert(uffd_fd >= 0);
+    close(uffd_fd);
+}
+
+/**
+ * uffd_register_memory: register a memory range with the userfaultfd
+ *
+ * Returns 0 on success, -1 in case of error
+ *
+ * @uffd_fd: userfaultfd file descriptor
+ * @addr: base address of the range
+ * @length: length of the range
+ * @track_mode: UFFDIO_REGISTER_MODE_* bits
+ * @ioctls: if not NULL, where to store the ioctls supported on the range
+ */
+int uffd_register_memory(int uffd_fd, void *addr, uint64_t length,
+                         uint64_t track_mode, uint64_t *ioctls)
+{
+    struct uffdio_register uffd_register;
+
+    uffd_register.range.start = (uintptr_t) addr;
+    uffd_register.range.len = length;
+    uffd_register.mode = track_mode;
+
+    if (ioctl(uffd_fd, UFFDIO_REGISTER, &uffd_register)) {
+        error_report("%s: UFFDIO_REGISTER failed: addr=%p length=%" PRIu64
+                     " mode=%" PRIx64 ": %s", __func__, addr, length,
+                     track_mode, strerror(errno));
+        return -1;
+    }
+    if (ioctls) {
+        *ioctls = uffd_register.ioctls;
+    }
+
+    return 0;
+}
+
+int uffd_unregister_memory(int uffd_fd, void *addr, uint64_t length)
+{
+    struct uffdio_range uffd_range;
+
+    uffd_range.start = (uintptr_t) addr;
+    uffd_range.len = length;
+
+    if (ioctl(uffd_fd, UFFDIO_UNREGISTER, &uffd_range)) {
+        error_report("%s: UFFDIO_UNREGISTER failed: addr=%p length=%" PRIu64
+                     ": %s", __func__, addr, length, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int uffd_change_protection(int uffd_fd, void *addr, uint64_t length,
+                           bool wp, bool dont_wake)
+{
+    struct uffdio_writeprotect uffd_writeprotect;
+
+    uffd_writeprotect.range.start = (uintptr_t) addr;
+    uffd_writeprotect.range.len = length;
+    if (!wp && dont_wake) {
+        /* DONTWAKE is meaningful only on protection release */
+        uffd_writeprotect.mode = UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+    } else {
+        uffd_writeprotect.mode = (wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0);
+    }
+
+    trace_uffd_change_protection(addr, length, wp);
+    if (ioctl(uffd_fd, UFFDIO_WRITEPROTECT, &uffd_writeprotect)) {
+        error_report("%s: UFFDIO_WRITEPROTECT failed: addr=%p length=%" PRIu64
+                     " mode=%" PRIx64 ": %s", __func__, addr, length,
+                     (uint64_t) uffd_writeprotect.mode, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int uffd_read_events(int uffd_fd, struct uffd_msg *msgs, int count)
+{
+    size_t len = count * sizeof(msgs[0]);
+    ssize_t res;
+
+    do {
+        res = read(uffd_fd, msgs, len);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        error_report("%s: read() failed: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    if (res % sizeof(msgs[0])) {
+        error_report("%s: read() returned a partial message", __func__);
+        return -1;
+    }
+
+    return res / sizeof(msgs[0]);
+}